@@ -0,0 +1,606 @@
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <future>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include "QProcess.h"
+#include "QLeanProcess.h"
+#include "QShellSession.h"
+
+using QClock = std::chrono::steady_clock;
+
+static double ElapsedMs(const QClock::time_point& from, const QClock::time_point& to)
+{
+	return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+//----------------------------------------------------------------
+// Time to first line: pipe vs pseudo console
+// With a pipe the child's stdio is fully buffered, so the line only
+// shows up when the buffer fills or the child exits
+//----------------------------------------------------------------
+static double MeasureFirstLine(bool isUsePseudoConsole)
+{
+	std::atomic_bool bReady(false);
+	std::string strSeen;
+	QClock::time_point firstLine;
+
+	QPROCESSCONFIG config = QPROCESSCONFIG("python -c \"import time; print('ready'); time.sleep(2)\"", "",
+		[&](const char* data, const size_t& size) {
+			if (bReady) return;
+			strSeen.append(data, size);
+			if (strSeen.find("ready") != std::string::npos)
+			{
+				firstLine = QClock::now();
+				bReady = true;
+			}
+		});
+	config.isUsePseudoConsole = isUsePseudoConsole;
+
+	QClock::time_point start = QClock::now();
+	QProcess process(config);
+
+	while (!bReady && ElapsedMs(start, QClock::now()) < 5000)
+		Sleep(1);
+
+	process.Close();
+	return bReady ? ElapsedMs(start, firstLine) : -1.0;
+}
+
+void BenchmarkFirstLine(int nIterations)
+{
+	for (bool isUsePseudoConsole : { false, true })
+	{
+		double totalMs = 0;
+		int nReceived = 0;
+		for (int i = 0; i < nIterations; ++i)
+		{
+			double ms = MeasureFirstLine(isUsePseudoConsole);
+			if (ms < 0) continue;
+			totalMs += ms;
+			nReceived++;
+		}
+
+		std::cout << (isUsePseudoConsole ? "PTY " : "Pipe") << " time to first line: ";
+		if (nReceived == 0)
+			std::cout << "no output" << std::endl;
+		else
+			std::cout << totalMs / nReceived << " ms (" << nReceived << "/" << nIterations << ")" << std::endl;
+	}
+}
+
+//----------------------------------------------------------------
+// Commands per second: one shell per command vs persistent session
+//----------------------------------------------------------------
+void BenchmarkShellSession(int nCommands)
+{
+	QClock::time_point start = QClock::now();
+	for (int i = 0; i < nCommands; ++i)
+	{
+		QProcess process(QPROCESSCONFIG("cmd /c echo hi", "",
+			[](const char*, const size_t&) {}));
+		process.WaitForExit(INFINITE);
+		process.Close();
+	}
+	double spawnMs = ElapsedMs(start, QClock::now());
+
+	QShellSession session;
+	std::vector<std::future<QSHELLRESULT>> results;
+	results.reserve(nCommands);
+
+	start = QClock::now();
+	for (int i = 0; i < nCommands; ++i)
+		results.push_back(session.Submit("echo hi"));
+	for (auto& result : results)
+		result.wait();
+	double sessionMs = ElapsedMs(start, QClock::now());
+
+	std::cout << "Spawn per command: " << nCommands * 1000.0 / spawnMs << " commands/sec" << std::endl;
+	std::cout << "Shell session:     " << nCommands * 1000.0 / sessionMs << " commands/sec" << std::endl;
+}
+
+//----------------------------------------------------------------
+// Fan-out read: many children writing to their stdout at once.
+// CPU per GB of this process, and I/O calls against a plain
+// blocking ReadFile thread per pipe
+//----------------------------------------------------------------
+static double ProcessCpuMs()
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (!GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit, &ftKernel, &ftUser))
+		return 0;
+
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = ftKernel.dwLowDateTime;
+	kernel.HighPart = ftKernel.dwHighDateTime;
+	user.LowPart = ftUser.dwLowDateTime;
+	user.HighPart = ftUser.dwHighDateTime;
+
+	//100 ns units
+	return (kernel.QuadPart + user.QuadPart) / 10000.0;
+}
+
+static void MeasureBlockingRead(int nChildren, const std::string& strFile)
+{
+	std::atomic<std::uint64_t> nBytes(0);
+	std::atomic<std::uint64_t> nCalls(0);
+
+	double cpuStart = ProcessCpuMs();
+	QClock::time_point start = QClock::now();
+
+	std::vector<std::thread> readers;
+	std::vector<HANDLE> children;
+	readers.reserve(nChildren);
+	children.reserve(nChildren);
+	for (int i = 0; i < nChildren; ++i)
+	{
+		SECURITY_ATTRIBUTES sa;
+		sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+		sa.lpSecurityDescriptor = nullptr;
+		sa.bInheritHandle = TRUE;
+
+		HANDLE hRead = INVALID_HANDLE_VALUE;
+		HANDLE hWrite = INVALID_HANDLE_VALUE;
+		if (!CreatePipe(&hRead, &hWrite, &sa, 0))
+			continue;
+		SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+
+		STARTUPINFOA si;
+		ZeroMemory(&si, sizeof(STARTUPINFOA));
+		si.cb = sizeof(STARTUPINFOA);
+		si.hStdOutput = hWrite;
+		si.dwFlags |= STARTF_USESTDHANDLES;
+
+		PROCESS_INFORMATION pi;
+		ZeroMemory(&pi, sizeof(PROCESS_INFORMATION));
+		std::string strCommand = "cmd /c type \"" + strFile + "\"";
+		BOOL bCreated = CreateProcessA(nullptr, strCommand.data(), nullptr, nullptr,
+			TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi);
+
+		//Child holds the only write end, ReadFile sees the pipe break when it exits
+		CloseHandle(hWrite);
+		if (!bCreated)
+		{
+			CloseHandle(hRead);
+			continue;
+		}
+		CloseHandle(pi.hThread);
+		children.push_back(pi.hProcess);
+
+		//Same buffer size as the engine
+		readers.emplace_back([hRead, &nBytes, &nCalls]() {
+			std::unique_ptr<char[]> buffer(new char[16 * 1024]);
+			DWORD dwRead = 0;
+			for (;;)
+			{
+				nCalls++;
+				if (!ReadFile(hRead, buffer.get(), 16 * 1024, &dwRead, nullptr) || dwRead == 0)
+					break;
+				nBytes += dwRead;
+			}
+			CloseHandle(hRead);
+		});
+	}
+
+	for (auto& reader : readers)
+		reader.join();
+	for (HANDLE hProcess : children)
+		CloseHandle(hProcess);
+
+	double wallMs = ElapsedMs(start, QClock::now());
+	double cpuMs = ProcessCpuMs() - cpuStart;
+	double gb = nBytes / (1024.0 * 1024.0 * 1024.0);
+
+	std::cout << "Blocking read  : " << nBytes / (1024 * 1024) << " MB in " << wallMs << " ms, "
+		<< (gb > 0 ? cpuMs / gb : 0) << " CPU ms/GB"
+		<< ", " << nCalls * 1000.0 / wallMs << " I/O calls/sec ("
+		<< nCalls << " ReadFile, " << readers.size() << " threads)" << std::endl;
+}
+
+static void MeasureFanOut(QIoEngine ioEngine, int nChildren, const std::string& strFile)
+{
+	std::atomic<std::uint64_t> nBytes(0);
+	QIOENGINESTATS before = QCompletionEngine::Shared() ? QCompletionEngine::Shared()->GetStats() : QIOENGINESTATS();
+
+	double cpuStart = ProcessCpuMs();
+	QClock::time_point start = QClock::now();
+
+	std::vector<std::unique_ptr<QProcess>> processes;
+	processes.reserve(nChildren);
+	for (int i = 0; i < nChildren; ++i)
+	{
+		QPROCESSCONFIG config = QPROCESSCONFIG("cmd /c type \"" + strFile + "\"", "",
+			[&nBytes](const char*, const size_t& size) { nBytes += size; });
+		config.isRedirectStdInput = false;
+		config.ioEngine = ioEngine;
+		processes.push_back(std::make_unique<QProcess>(config));
+	}
+
+	for (auto& process : processes)
+	{
+		process->WaitForExit(INFINITE);
+		process->Close();
+	}
+
+	double wallMs = ElapsedMs(start, QClock::now());
+	double cpuMs = ProcessCpuMs() - cpuStart;
+	double gb = nBytes / (1024.0 * 1024.0 * 1024.0);
+
+	std::cout << (ioEngine == QIoEngine::CompletionPort ? "Completion port" : "Polling        ")
+		<< ": " << nBytes / (1024 * 1024) << " MB in " << wallMs << " ms, "
+		<< (gb > 0 ? cpuMs / gb : 0) << " CPU ms/GB";
+
+	if (ioEngine == QIoEngine::CompletionPort && QCompletionEngine::Shared())
+	{
+		QIOENGINESTATS after = QCompletionEngine::Shared()->GetStats();
+		std::uint64_t nCalls = (after.nReadCalls - before.nReadCalls) +
+			(after.nWaitCalls - before.nWaitCalls);
+		std::cout << ", " << nCalls * 1000.0 / wallMs << " I/O calls/sec ("
+			<< after.nInlineCompletions - before.nInlineCompletions << " inline, "
+			<< after.nCompletions - before.nCompletions << " packets)";
+	}
+	std::cout << std::endl;
+}
+
+void BenchmarkFanOut(int nChildren, std::size_t nBytesPerChild)
+{
+	std::string strFile = (std::filesystem::temp_directory_path() / "QProcessFanOut.txt").string();
+	{
+		std::ofstream file(strFile, std::ios::binary);
+		std::string strLine(127, 'x');
+		strLine += '\n';
+		for (std::size_t n = 0; n < nBytesPerChild; n += strLine.size())
+			file << strLine;
+	}
+
+	MeasureBlockingRead(nChildren, strFile);
+	MeasureFanOut(QIoEngine::Polling, nChildren, strFile);
+	MeasureFanOut(QIoEngine::CompletionPort, nChildren, strFile);
+
+	std::filesystem::remove(strFile);
+}
+
+//----------------------------------------------------------------
+// Watchdog: cost of arming, cancelling and carrying many timers
+//----------------------------------------------------------------
+void BenchmarkTimerWheel(int nTimers)
+{
+	QTimerWheel wheel(10);
+	std::vector<QTIMER> timers(nTimers);
+	std::atomic<int> nFired(0);
+
+	for (auto& timer : timers)
+		timer.callback = [&nFired]() { nFired++; };
+
+	//Spread over 10 to 70 seconds, none due while measuring
+	QClock::time_point start = QClock::now();
+	for (int i = 0; i < nTimers; ++i)
+		wheel.Arm(&timers[i], 10000 + (i * 7919) % 60000);
+	double armMs = ElapsedMs(start, QClock::now());
+
+	double cpuStart = ProcessCpuMs();
+	Sleep(2000);
+	double idleCpuMs = ProcessCpuMs() - cpuStart;
+
+	start = QClock::now();
+	for (auto& timer : timers)
+		wheel.Cancel(&timer);
+	double cancelMs = ElapsedMs(start, QClock::now());
+
+	std::cout << nTimers << " timers: arm " << armMs * 1e6 / nTimers << " ns"
+		<< ", cancel " << cancelMs * 1e6 / nTimers << " ns"
+		<< ", CPU while armed " << idleCpuMs / 2.0 << " ms/s"
+		<< ", fired " << nFired << std::endl;
+}
+
+//----------------------------------------------------------------
+// Retention ring: writer throughput while many threads take snapshots
+//----------------------------------------------------------------
+void BenchmarkRetention(std::size_t nCapacity)
+{
+	std::string strChunk(4096, 'x');
+	for (std::size_t i = 127; i < strChunk.size(); i += 128)
+		strChunk[i] = '\n';
+
+	for (int nReaders : { 0, 1, 4, 16, 64 })
+	{
+		QRetentionRing ring(nCapacity);
+		std::atomic_bool bStop(false);
+		std::atomic<std::uint64_t> nSnapshots(0);
+		std::atomic<std::uint64_t> nShort(0);	//Tail cut because the writer lapped the copy
+
+		std::vector<std::thread> readers;
+		for (int i = 0; i < nReaders; ++i)
+		{
+			readers.emplace_back([&]() {
+				while (!bStop)
+				{
+					QRETENTIONSNAPSHOT snapshot = ring.Snapshot();
+					if (snapshot.strTail.size() < (std::min<std::uint64_t>)(snapshot.nTotalBytes, ring.Capacity()))
+						nShort++;
+					nSnapshots++;
+				}
+			});
+		}
+
+		QClock::time_point start = QClock::now();
+		std::uint64_t nWritten = 0;
+		while (ElapsedMs(start, QClock::now()) < 1000)
+		{
+			for (int i = 0; i < 256; ++i)
+				ring.Append(strChunk.data(), strChunk.size());
+			nWritten += 256 * strChunk.size();
+		}
+		double ms = ElapsedMs(start, QClock::now());
+
+		bStop = true;
+		for (auto& reader : readers)
+			reader.join();
+
+		std::cout << nReaders << " readers: writer " << nWritten / 1024.0 / 1024.0 * 1000.0 / ms << " MB/s, "
+			<< nSnapshots * 1000.0 / ms << " snapshots/sec, "
+			<< nShort << " cut" << std::endl;
+	}
+}
+
+//----------------------------------------------------------------
+// Stdin fan-out: same payload to many children.
+// WriteCommand one after another vs BroadcastWrite on a shared buffer
+//----------------------------------------------------------------
+enum class QFanInMode
+{
+	WriteCommand,
+	Broadcast,
+	BroadcastCompletionPort
+};
+
+static double MeasureFanIn(QFanInMode mode, int nChildren, const std::shared_ptr<const std::string>& payload)
+{
+	//Child reads exactly the payload and leaves
+	std::string strCommand = "python -c \"import sys,itertools;r=sys.stdin.buffer;t=0;"
+		"any((t:=t+len(r.read1(1<<20)))>=" + std::to_string(payload->size()) + " for _ in itertools.repeat(0))\"";
+
+	std::vector<std::unique_ptr<QProcess>> processes;
+	std::vector<QProcess*> targets;
+	for (int i = 0; i < nChildren; ++i)
+	{
+		QPROCESSCONFIG config = QPROCESSCONFIG(strCommand);
+		config.isRedirectStdOutput = false;
+		config.isRedirectStdError = false;
+		if (mode == QFanInMode::BroadcastCompletionPort)
+			config.ioEngine = QIoEngine::CompletionPort;
+
+		processes.push_back(std::make_unique<QProcess>(config));
+		targets.push_back(processes.back().get());
+	}
+
+	QClock::time_point start = QClock::now();
+
+	if (mode == QFanInMode::WriteCommand)
+	{
+		for (QProcess* pProcess : targets)
+			pProcess->WriteCommand(*payload);
+	}
+	else
+	{
+		QProcess::BroadcastWrite(targets, payload);
+	}
+
+	for (QProcess* pProcess : targets)
+		pProcess->WaitForExit(INFINITE);
+
+	double ms = ElapsedMs(start, QClock::now());
+
+	for (auto& process : processes)
+		process->Close();
+
+	return ms;
+}
+
+void BenchmarkBroadcast(int nChildren, std::size_t nPayloadBytes)
+{
+	auto payload = std::make_shared<const std::string>(nPayloadBytes, 'x');
+	double totalMB = nPayloadBytes / (1024.0 * 1024.0) * nChildren;
+
+	for (QFanInMode mode : { QFanInMode::WriteCommand, QFanInMode::Broadcast, QFanInMode::BroadcastCompletionPort })
+	{
+		double ms = MeasureFanIn(mode, nChildren, payload);
+		std::cout << (mode == QFanInMode::WriteCommand ? "WriteCommand each  " :
+			mode == QFanInMode::Broadcast ? "BroadcastWrite     " : "BroadcastWrite IOCP")
+			<< ": " << ms << " ms, " << totalMB * 1000.0 / ms << " MB/s" << std::endl;
+	}
+}
+
+//----------------------------------------------------------------
+// Per-chunk dispatch: runtime QProcess path vs QLeanProcess policy
+// template, then reader throughput of each
+//----------------------------------------------------------------
+static std::atomic<std::uint64_t> g_nSink(0);
+
+template<typename Func>
+static void DeliverChunks(Func& func, const char* pChunk, std::size_t nChunk, int nChunks)
+{
+	for (int i = 0; i < nChunks; ++i)
+		func(pChunk, nChunk);
+}
+
+static double MeasureLeanRead(const std::string& strCommand, std::uint64_t& nBytes, std::uint64_t& nChunks)
+{
+	nBytes = 0;
+	nChunks = 0;
+	auto onOut = [&nBytes, &nChunks](const char*, const size_t& size) { nBytes += size; nChunks++; };
+
+	QClock::time_point start = QClock::now();
+	QLeanProcess<QRedirectStdOut, QCallback<decltype(onOut)>, QChar<char>> process(strCommand, onOut);
+	process.WaitForExit(INFINITE);
+	process.Close();
+	return ElapsedMs(start, QClock::now());
+}
+
+static double MeasureRuntimeRead(const std::string& strCommand, std::uint64_t& nBytes, std::uint64_t& nChunks)
+{
+	std::atomic<std::uint64_t> nReceived(0);
+	std::atomic<std::uint64_t> nCalls(0);
+	QPROCESSCONFIG config = QPROCESSCONFIG(strCommand, "",
+		[&nReceived, &nCalls](const char*, const size_t& size) { nReceived += size; nCalls++; });
+	config.isRedirectStdError = false;
+	config.isRedirectStdInput = false;
+
+	QClock::time_point start = QClock::now();
+	QProcess process(config);
+	process.WaitForExit(INFINITE);
+	process.Close();
+	nBytes = nReceived;
+	nChunks = nCalls;
+	return ElapsedMs(start, QClock::now());
+}
+
+void BenchmarkChunkDispatch(int nChunks)
+{
+	char chunk[4096] = {};
+	auto onChunk = [](const char* data, const size_t& size) {
+		g_nSink.fetch_add(size + data[0], std::memory_order_relaxed);
+	};
+
+	//Template: the callback stored in the process, called the way its reader calls it
+	typedef QLeanProcess<QRedirectStdOut, QCallback<decltype(onChunk)>, QChar<char>> QLeanStdOut;
+	QLeanStdOut lean("cmd /c rem", onChunk);
+	lean.WaitForExit(INFINITE);
+	lean.Close();
+
+	QClock::time_point start = QClock::now();
+	for (int i = 0; i < nChunks; ++i)
+		lean.DispatchStdOut(chunk, sizeof(chunk));
+	double leanMs = ElapsedMs(start, QClock::now());
+
+	//QProcess: type erased call, and the inline dispatcher in front of it
+	processFuncDataOutCallBack function = onChunk;
+	start = QClock::now();
+	DeliverChunks(function, chunk, sizeof(chunk), nChunks);
+	double functionMs = ElapsedMs(start, QClock::now());
+
+	QStreamDispatcher dispatcher(onChunk, nullptr, QDISPATCHCONFIG());
+	auto dispatch = [&dispatcher](const char* data, const size_t& size) {
+		dispatcher.Dispatch(QStreamDispatcher::ChannelOut, data, size);
+	};
+	start = QClock::now();
+	DeliverChunks(dispatch, chunk, sizeof(chunk), nChunks);
+	double dispatcherMs = ElapsedMs(start, QClock::now());
+
+	std::cout << "Per chunk: template direct " << leanMs * 1e6 / nChunks << " ns"
+		<< ", std::function " << functionMs * 1e6 / nChunks << " ns"
+		<< ", inline dispatcher " << dispatcherMs * 1e6 / nChunks << " ns" << std::endl;
+
+	std::cout << "sizeof QProcess " << sizeof(QProcess)
+		<< ", stdout-only lambda template " << sizeof(QLeanStdOut)
+		<< std::endl;
+
+	//Reader throughput, not dispatch cost: includes spawn, the child writing,
+	//and each reader's own strategy (QProcess polls, the template blocks in ReadFile)
+	std::string strFile = (std::filesystem::temp_directory_path() / "QProcessChunks.txt").string();
+	{
+		std::ofstream file(strFile, std::ios::binary);
+		std::string strLine(127, 'x');
+		strLine += '\n';
+		for (int i = 0; i < 2 * 1024 * 1024; ++i)
+			file << strLine;
+	}
+
+	std::string strCommand = "cmd /c type \"" + strFile + "\"";
+	std::uint64_t nBytes = 0;
+	std::uint64_t nReadChunks = 0;
+
+	double runtimeMs = MeasureRuntimeRead(strCommand, nBytes, nReadChunks);
+	std::cout << "Reader throughput QProcess:     " << nBytes / 1024.0 / 1024.0 * 1000.0 / runtimeMs << " MB/s ("
+		<< nReadChunks << " reads, " << (nReadChunks > 0 ? nBytes / nReadChunks : 0) << " bytes each)" << std::endl;
+
+	double leanReadMs = MeasureLeanRead(strCommand, nBytes, nReadChunks);
+	std::cout << "Reader throughput QLeanProcess: " << nBytes / 1024.0 / 1024.0 * 1000.0 / leanReadMs << " MB/s ("
+		<< nReadChunks << " reads, " << (nReadChunks > 0 ? nBytes / nReadChunks : 0) << " bytes each)" << std::endl;
+
+	std::filesystem::remove(strFile);
+}
+
+//----------------------------------------------------------------
+// Batch spawn: wall time until a fleet of children is running,
+// one constructor after another vs SpawnMany
+//----------------------------------------------------------------
+static std::vector<QPROCESSCONFIG> MakeSpawnConfigs(int nChildren)
+{
+	//pause waits on the stdin pipe, so every child stays alive until closed
+	std::vector<QPROCESSCONFIG> configs;
+	configs.reserve(nChildren);
+	for (int i = 0; i < nChildren; ++i)
+	{
+		QPROCESSCONFIG config = QPROCESSCONFIG("cmd /c pause", "", [](const char*, const size_t&) {});
+		config.ioEngine = QIoEngine::CompletionPort;
+		configs.push_back(std::move(config));
+	}
+	return configs;
+}
+
+void BenchmarkSpawn(int nChildren)
+{
+	std::vector<QPROCESSCONFIG> configs = MakeSpawnConfigs(nChildren);
+
+	std::vector<std::unique_ptr<QProcess>> processes;
+	processes.reserve(nChildren);
+	QClock::time_point start = QClock::now();
+	for (const auto& config : configs)
+		processes.push_back(std::make_unique<QProcess>(config));
+	double serialMs = ElapsedMs(start, QClock::now());
+
+	for (auto& process : processes)
+		process->Close();
+	processes.clear();
+
+	start = QClock::now();
+	std::vector<QSPAWNRESULT> results = QProcess::SpawnMany(configs);
+	double batchMs = ElapsedMs(start, QClock::now());
+
+	std::size_t nFailed = 0;
+	for (auto& result : results)
+	{
+		if (!result.isSuccess)
+			nFailed++;
+		else
+			result.pProcess->Close();
+	}
+
+	std::cout << "One by one: " << nChildren << " children running in " << serialMs << " ms" << std::endl;
+	std::cout << "SpawnMany:  " << nChildren << " children running in " << batchMs << " ms"
+		<< ", failed " << nFailed << std::endl;
+}
+
+void RunBenchmarks(const std::string& strName)
+{
+	bool bAll = strName.empty() || strName == "all";
+
+	if (bAll || strName == "firstline")
+		BenchmarkFirstLine(10);
+
+	if (bAll || strName == "session")
+		BenchmarkShellSession(200);
+
+	if (bAll || strName == "fanout")
+		BenchmarkFanOut(1000, 1024 * 1024);
+
+	if (bAll || strName == "timers")
+		BenchmarkTimerWheel(100000);
+
+	if (bAll || strName == "retention")
+		BenchmarkRetention(64 * 1024);
+
+	if (bAll || strName == "broadcast")
+		BenchmarkBroadcast(64, 1024 * 1024 * 1024);
+
+	if (bAll || strName == "dispatch")
+		BenchmarkChunkDispatch(10000000);
+
+	if (bAll || strName == "spawn")
+		BenchmarkSpawn(1000);
+}
@@ -0,0 +1,209 @@
+#include <memory>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <tlhelp32.h>
+#include "QChildProcess.h"
+#include "QPseudoConsole.h"
+#include "Utility.h"
+
+template<typename CharT>
+static bool CreateChild(std::basic_string<CharT>& strCommandLine,
+	const std::basic_string<CharT>& strCurrentDirectory,
+	std::basic_string<CharT>& strEnvironment,
+	const QCHILDOPTIONS& options,
+	PROCESS_INFORMATION& pi)
+{
+	typedef std::conditional_t<std::is_same_v<CharT, wchar_t>, STARTUPINFOEXW, STARTUPINFOEXA> StartupInfo;
+
+	StartupInfo si;
+	ZeroMemory(&pi, sizeof(PROCESS_INFORMATION));
+	ZeroMemory(&si, sizeof(StartupInfo));
+	si.StartupInfo.cb = sizeof(StartupInfo);
+
+	DWORD creationFlags = 0;
+	HANDLE inheritHandles[3];
+	DWORD nInheritHandles = 0;
+
+	DWORD_PTR attribute = 0;
+	void* pAttributeValue = nullptr;
+	SIZE_T nAttributeSize = 0;
+
+	if (options.hPseudoConsole != nullptr)
+	{
+		//Child attaches to the pseudo console.
+		//Must not set STARTF_USESTDHANDLES, it would override the console handles
+		attribute = PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE;
+		pAttributeValue = options.hPseudoConsole;
+		nAttributeSize = sizeof(void*);
+	}
+	else
+	{
+		si.StartupInfo.hStdOutput = options.hStdOut;
+		si.StartupInfo.hStdInput = options.hStdIn;
+		si.StartupInfo.hStdError = options.hStdErr;
+
+		for (HANDLE h : { options.hStdOut, options.hStdIn, options.hStdErr })
+		{
+			if (h != INVALID_HANDLE_VALUE && h != nullptr &&
+				std::find(inheritHandles, inheritHandles + nInheritHandles, h) == inheritHandles + nInheritHandles)
+				inheritHandles[nInheritHandles++] = h;
+		}
+
+		if (nInheritHandles > 0)
+		{
+			si.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+			attribute = PROC_THREAD_ATTRIBUTE_HANDLE_LIST;
+			pAttributeValue = inheritHandles;
+			nAttributeSize = nInheritHandles * sizeof(HANDLE);
+		}
+
+		if (options.isCreateNoWindow)
+			creationFlags |= CREATE_NO_WINDOW;
+	}
+
+	std::unique_ptr<char[]> attributeBuffer;
+	if (pAttributeValue != nullptr)
+	{
+		SIZE_T attributeSize = 0;
+		InitializeProcThreadAttributeList(nullptr, 1, 0, &attributeSize);
+		attributeBuffer.reset(new char[attributeSize]);
+		si.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributeBuffer.get());
+
+		if (!InitializeProcThreadAttributeList(si.lpAttributeList, 1, 0, &attributeSize))
+			return false;
+
+		if (!UpdateProcThreadAttribute(si.lpAttributeList,
+			0,
+			attribute,
+			pAttributeValue,
+			nAttributeSize,
+			nullptr,
+			nullptr))
+		{
+			DWORD dwError = GetLastError();
+			DeleteProcThreadAttributeList(si.lpAttributeList);
+			SetLastError(dwError);
+			return false;
+		}
+
+		creationFlags |= EXTENDED_STARTUPINFO_PRESENT;
+	}
+
+	const CharT* pCurrentDirectory = strCurrentDirectory.empty() ? nullptr : strCurrentDirectory.c_str();
+	CharT* pEnvironment = strEnvironment.empty() ? nullptr : strEnvironment.data();
+	BOOL bCreated;
+
+	if constexpr (std::is_same_v<CharT, wchar_t>)
+	{
+		bCreated = CreateProcessW(nullptr,
+			strCommandLine.data(),
+			nullptr,
+			nullptr,
+			nInheritHandles > 0,
+			creationFlags | CREATE_UNICODE_ENVIRONMENT,
+			pEnvironment,
+			pCurrentDirectory,
+			&si.StartupInfo,
+			&pi);
+	}
+	else
+	{
+		bCreated = CreateProcessA(nullptr,
+			strCommandLine.data(),
+			nullptr,
+			nullptr,
+			nInheritHandles > 0,
+			creationFlags,
+			pEnvironment,
+			pCurrentDirectory,
+			&si.StartupInfo,
+			&pi);
+	}
+
+	DWORD dwError = GetLastError();
+	if (si.lpAttributeList != nullptr)
+		DeleteProcThreadAttributeList(si.lpAttributeList);
+	SetLastError(dwError);
+
+	return bCreated != FALSE;
+}
+
+bool QChildProcess::Create(std::string& strCommandLine,
+	const std::string& strCurrentDirectory,
+	std::string& strEnvironment,
+	const QCHILDOPTIONS& options,
+	PROCESS_INFORMATION& pi)
+{
+	return CreateChild(strCommandLine, strCurrentDirectory, strEnvironment, options, pi);
+}
+
+bool QChildProcess::Create(std::wstring& strCommandLine,
+	const std::wstring& strCurrentDirectory,
+	std::wstring& strEnvironment,
+	const QCHILDOPTIONS& options,
+	PROCESS_INFORMATION& pi)
+{
+	return CreateChild(strCommandLine, strCurrentDirectory, strEnvironment, options, pi);
+}
+
+void QChildProcess::KillTree(DWORD dwProcessId, HANDLE hProcess)
+{
+	if (dwProcessId == 0) return;
+
+	//Before the kill, so the tree is still complete
+	HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+
+	if (hProcess != INVALID_HANDLE_VALUE && hProcess != nullptr)
+		TerminateProcess(hProcess, 2);
+
+	if (hSnapshot == INVALID_HANDLE_VALUE) return;
+
+	//Callers kill while handling a failure, so out of memory only stops the walk
+	try
+	{
+		//Process id, parent id
+		std::vector<std::pair<DWORD, DWORD>> processes;
+		PROCESSENTRY32 process;
+		ZeroMemory(&process, sizeof(process));
+		process.dwSize = sizeof(process);
+
+		if (Process32First(hSnapshot, &process))
+		{
+			do
+			{
+				processes.emplace_back(process.th32ProcessID, process.th32ParentProcessID);
+			} while (Process32Next(hSnapshot, &process));
+		}
+		CloseHandle(hSnapshot);
+		hSnapshot = INVALID_HANDLE_VALUE;
+
+		//Breadth first down from the child. A reused id can not bring a process in twice
+		std::vector<DWORD> tree{ dwProcessId };
+		for (std::size_t i = 0; i < tree.size(); ++i)
+		{
+			for (const auto& [id, parentId] : processes)
+			{
+				if (parentId != tree[i] ||
+					std::find(tree.begin(), tree.end(), id) != tree.end())
+					continue;
+
+				tree.push_back(id);
+
+				HANDLE hDescendant = OpenProcess(PROCESS_TERMINATE, FALSE, id);
+				if (hDescendant)
+				{
+					TerminateProcess(hDescendant, 2);
+					CloseHandle(hDescendant);
+				}
+			}
+		}
+	}
+	catch (const std::bad_alloc&)
+	{
+		PrintError("KillTree out of memory");
+		if (hSnapshot != INVALID_HANDLE_VALUE)
+			CloseHandle(hSnapshot);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <Windows.h>
+
+typedef struct _QCHILDOPTIONS {
+	HANDLE hStdOut;			//INVALID_HANDLE_VALUE when not redirected
+	HANDLE hStdIn;
+	HANDLE hStdErr;
+	void* hPseudoConsole;	//HPCON to attach to, std handles are not used then
+	bool isCreateNoWindow;	//Pipe mode only, it would detach the child from a pseudo console
+
+public:
+	_QCHILDOPTIONS()
+		: hStdOut(INVALID_HANDLE_VALUE)
+		, hStdIn(INVALID_HANDLE_VALUE)
+		, hStdErr(INVALID_HANDLE_VALUE)
+		, hPseudoConsole(nullptr)
+		, isCreateNoWindow(true)
+	{
+	}
+}QCHILDOPTIONS, *PQCHILDOPTIONS;
+
+/// <summary>
+/// Child creation and termination shared by QProcess and QLeanProcess&lt;Policies...&gt;
+/// </summary>
+class QChildProcess
+{
+public:
+	QChildProcess() = delete;
+
+	/// <summary>
+	/// Start child. Only its own std handles are inherited, so children
+	/// created at the same time on other threads do not get each other's pipe ends
+	/// </summary>
+	/// <param name="strCommandLine">May be modified by CreateProcess</param>
+	/// <param name="strCurrentDirectory">Empty for the current one</param>
+	/// <param name="strEnvironment">Block of NUL separated entries, empty to inherit</param>
+	/// <param name="options"></param>
+	/// <param name="pi">Caller closes both handles</param>
+	/// <returns>false with last error set</returns>
+	static bool Create(std::string& strCommandLine,
+		const std::string& strCurrentDirectory,
+		std::string& strEnvironment,
+		const QCHILDOPTIONS& options,
+		PROCESS_INFORMATION& pi);
+
+	static bool Create(std::wstring& strCommandLine,
+		const std::wstring& strCurrentDirectory,
+		std::wstring& strEnvironment,
+		const QCHILDOPTIONS& options,
+		PROCESS_INFORMATION& pi);
+
+	/// <summary>
+	/// Terminate process and everything it started
+	/// </summary>
+	/// <param name="dwProcessId"></param>
+	/// <param name="hProcess">Needs PROCESS_TERMINATE</param>
+	static void KillTree(DWORD dwProcessId, HANDLE hProcess);
+};
\ No newline at end of file
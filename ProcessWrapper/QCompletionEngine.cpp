@@ -0,0 +1,542 @@
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <objbase.h>
+#include <sddl.h>
+#include "QCompletionEngine.h"
+
+#ifndef FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
+#define FILE_SKIP_COMPLETION_PORT_ON_SUCCESS 0x1
+#endif
+
+//Packets dequeued per GetQueuedCompletionStatusEx
+static constexpr ULONG kCompletionBatch = 64;
+
+//Reads finished inline before the stream yields to the others
+static constexpr int kMaxInlineReads = 16;
+
+//Largest single WriteFile
+static constexpr std::size_t kMaxWriteChunk = 1024 * 1024;
+
+//Completion key asking a worker to leave
+static constexpr ULONG_PTR kShutdownKey = 0;
+
+struct QIoStream
+{
+	OVERLAPPED overlapped;
+	HANDLE hFile;
+	bool isRead;
+	bool isSkipOnSuccess;	//No packet when ReadFile/WriteFile succeed at once
+	char* pBuffer;
+	QIoReadCallback onData;
+	QIoEndCallback onEnd;
+
+	std::mutex lock;
+	std::condition_variable cvIdle;
+	bool isPending;		//I/O or re-arm packet in flight
+	bool isClosing;
+	bool isEnded;
+
+	//Write chain, front is being written
+	std::deque<std::shared_ptr<const std::string>> writes;
+	std::size_t nWriteOffset;
+	std::size_t nBacklog;
+};
+
+//Drop written bytes from the front of the chain. Stream lock held
+static void AdvanceWrites(QIoStream* pStream, std::size_t nWritten)
+{
+	pStream->nBacklog -= nWritten;
+	pStream->nWriteOffset += nWritten;
+	while (!pStream->writes.empty() &&
+		pStream->nWriteOffset >= pStream->writes.front()->size())
+	{
+		pStream->nWriteOffset -= pStream->writes.front()->size();
+		pStream->writes.pop_front();
+	}
+}
+
+QCompletionEngine::QCompletionEngine(std::size_t nThreads, std::size_t nBufferSize, std::size_t nBuffers)
+	: m_hPort(nullptr)
+	, m_nBufferSize(nBufferSize)
+	, m_pSlab(nullptr)
+	, m_nSlabBuffers(0)
+	, m_nReadCalls(0)
+	, m_nWriteCalls(0)
+	, m_nWaitCalls(0)
+	, m_nCompletions(0)
+	, m_nInlineCompletions(0)
+	, m_nBytesRead(0)
+	, m_nBytesWritten(0)
+{
+	m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, static_cast<DWORD>(nThreads));
+	if (m_hPort == nullptr) return;
+
+	m_pSlab = static_cast<char*>(VirtualAlloc(nullptr, nBufferSize * nBuffers, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if (m_pSlab != nullptr)
+	{
+		m_nSlabBuffers = nBuffers;
+		m_freeBuffers.reserve(nBuffers);
+		for (std::size_t i = nBuffers; i > 0; --i)
+			m_freeBuffers.push_back(m_pSlab + (i - 1) * nBufferSize);
+	}
+
+	m_threads.reserve(nThreads);
+	for (std::size_t i = 0; i < nThreads; ++i)
+		m_threads.emplace_back([this]() { WorkerLoop(); });
+}
+
+QCompletionEngine::~QCompletionEngine()
+{
+	for (std::size_t i = 0; i < m_threads.size(); ++i)
+		PostQueuedCompletionStatus(m_hPort, 0, kShutdownKey, nullptr);
+
+	for (auto& thread : m_threads)
+	{
+		if (thread.joinable())
+			thread.join();
+	}
+
+	if (m_hPort != nullptr)
+		CloseHandle(m_hPort);
+
+	if (m_pSlab != nullptr)
+		VirtualFree(m_pSlab, 0, MEM_RELEASE);
+}
+
+QCompletionEngine* QCompletionEngine::Shared()
+{
+	static std::unique_ptr<QCompletionEngine> engine(new QCompletionEngine(
+		std::max<std::size_t>(2, std::thread::hardware_concurrency()),
+		16 * 1024,
+		256));
+	return engine->IsValid() ? engine.get() : nullptr;
+}
+
+bool QCompletionEngine::IsValid() const noexcept
+{
+	return m_hPort != nullptr;
+}
+
+/// <summary>
+/// Pipe security granting access to the user of this process only.
+/// Built once and kept for the process lifetime, nullptr on failure
+/// </summary>
+static PSECURITY_DESCRIPTOR CurrentUserDescriptor()
+{
+	static PSECURITY_DESCRIPTOR pDescriptor = []() -> PSECURITY_DESCRIPTOR {
+		HANDLE hToken = nullptr;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &hToken))
+			return nullptr;
+
+		PSECURITY_DESCRIPTOR pResult = nullptr;
+		DWORD dwSize = 0;
+		GetTokenInformation(hToken, TokenUser, nullptr, 0, &dwSize);
+		std::unique_ptr<char[]> buffer(new char[dwSize]);
+
+		LPSTR pSid = nullptr;
+		if (GetTokenInformation(hToken, TokenUser, buffer.get(), dwSize, &dwSize) &&
+			ConvertSidToStringSidA(reinterpret_cast<PTOKEN_USER>(buffer.get())->User.Sid, &pSid))
+		{
+			//Protected DACL, full access for this user and nobody else
+			std::string strSddl = std::format("D:P(A;;GA;;;{})", pSid);
+			if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(strSddl.c_str(), SDDL_REVISION_1, &pResult, nullptr))
+				pResult = nullptr;
+			LocalFree(pSid);
+		}
+
+		CloseHandle(hToken);
+		return pResult;
+	}();
+
+	return pDescriptor;
+}
+
+bool QCompletionEngine::CreateOverlappedPipe(bool isParentRead, HANDLE& hParent, HANDLE& hChild)
+{
+	//Anonymous pipes can not do overlapped I/O, so name one with a random GUID.
+	//Only this user may open it, and FILE_FLAG_FIRST_PIPE_INSTANCE fails if the name is taken
+	GUID guid;
+	HRESULT hr = CoCreateGuid(&guid);
+	if (FAILED(hr))
+	{
+		SetLastError(static_cast<DWORD>(hr));
+		return false;
+	}
+
+	PSECURITY_DESCRIPTOR pDescriptor = CurrentUserDescriptor();
+	if (pDescriptor == nullptr)
+	{
+		SetLastError(ERROR_INVALID_SECURITY_DESCR);
+		return false;
+	}
+
+	std::string strName = std::format("\\\\.\\pipe\\QProcess.{:08X}-{:04X}-{:04X}-{:02X}{:02X}-{:02X}{:02X}{:02X}{:02X}{:02X}{:02X}",
+		guid.Data1, guid.Data2, guid.Data3,
+		guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+		guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
+
+	SECURITY_ATTRIBUTES saPipe;
+	saPipe.nLength = sizeof(SECURITY_ATTRIBUTES);
+	saPipe.lpSecurityDescriptor = pDescriptor;
+	saPipe.bInheritHandle = FALSE;
+
+	hParent = CreateNamedPipeA(strName.c_str(),
+		(isParentRead ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		1,
+		64 * 1024,
+		64 * 1024,
+		0,
+		&saPipe);
+
+	if (hParent == INVALID_HANDLE_VALUE)
+		return false;
+
+	//Child end stays synchronous, most programs can not handle an overlapped stdio handle
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+	sa.lpSecurityDescriptor = nullptr;
+	sa.bInheritHandle = TRUE;
+
+	hChild = CreateFileA(strName.c_str(),
+		isParentRead ? GENERIC_WRITE : GENERIC_READ,
+		0,
+		&sa,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr);
+
+	if (hChild == INVALID_HANDLE_VALUE)
+	{
+		DWORD dwError = GetLastError();
+		CloseHandle(hParent);
+		hParent = INVALID_HANDLE_VALUE;
+		SetLastError(dwError);
+		return false;
+	}
+
+	return true;
+}
+
+QIoStream* QCompletionEngine::RegisterRead(HANDLE hFile, QIoReadCallback onData, QIoEndCallback onEnd)
+{
+	QIoStream* pStream = Associate(hFile, true);
+	if (pStream == nullptr) return nullptr;
+
+	pStream->pBuffer = AcquireBuffer();
+	pStream->onData = std::move(onData);
+	pStream->onEnd = std::move(onEnd);
+
+	//First read goes out from an engine thread, so callbacks never run on the caller
+	pStream->isPending = true;
+	PostQueuedCompletionStatus(m_hPort, 0, reinterpret_cast<ULONG_PTR>(pStream), nullptr);
+	return pStream;
+}
+
+QIoStream* QCompletionEngine::RegisterWrite(HANDLE hFile)
+{
+	return Associate(hFile, false);
+}
+
+bool QCompletionEngine::Write(QIoStream* pStream, std::shared_ptr<const std::string> data)
+{
+	if (pStream == nullptr || pStream->isRead) return false;
+	if (data == nullptr || data->empty()) return true;
+
+	bool bStart = false;
+	{
+		std::lock_guard<std::mutex> lock(pStream->lock);
+		if (pStream->isClosing || pStream->isEnded) return false;
+
+		pStream->nBacklog += data->size();
+		pStream->writes.push_back(std::move(data));
+
+		//Nothing in flight, start the chain
+		if (!pStream->isPending)
+		{
+			pStream->isPending = true;
+			bStart = true;
+		}
+	}
+
+	if (bStart)
+		IssueWrite(pStream);
+	return true;
+}
+
+std::size_t QCompletionEngine::GetWriteBacklog(QIoStream* pStream) const
+{
+	if (pStream == nullptr) return 0;
+
+	std::lock_guard<std::mutex> lock(pStream->lock);
+	return pStream->nBacklog;
+}
+
+void QCompletionEngine::Unregister(QIoStream* pStream)
+{
+	if (pStream == nullptr) return;
+
+	std::unique_lock<std::mutex> lock(pStream->lock);
+	pStream->isClosing = true;
+
+	//Cancel again until idle, a read may be issued right after a cancel
+	while (pStream->isPending)
+	{
+		lock.unlock();
+		CancelIoEx(pStream->hFile, nullptr);
+		lock.lock();
+		pStream->cvIdle.wait_for(lock, std::chrono::milliseconds(10), [pStream]() {
+			return !pStream->isPending;
+		});
+	}
+	lock.unlock();
+
+	if (pStream->pBuffer != nullptr)
+		ReleaseBuffer(pStream->pBuffer);
+	delete pStream;
+}
+
+QIOENGINESTATS QCompletionEngine::GetStats() const
+{
+	QIOENGINESTATS stats;
+	stats.nReadCalls = m_nReadCalls.load();
+	stats.nWriteCalls = m_nWriteCalls.load();
+	stats.nWaitCalls = m_nWaitCalls.load();
+	stats.nCompletions = m_nCompletions.load();
+	stats.nInlineCompletions = m_nInlineCompletions.load();
+	stats.nBytesRead = m_nBytesRead.load();
+	stats.nBytesWritten = m_nBytesWritten.load();
+	return stats;
+}
+
+QIoStream* QCompletionEngine::Associate(HANDLE hFile, bool isRead)
+{
+	if (!IsValid() || hFile == INVALID_HANDLE_VALUE) return nullptr;
+
+	QIoStream* pStream = new QIoStream();
+	ZeroMemory(&pStream->overlapped, sizeof(OVERLAPPED));
+	pStream->hFile = hFile;
+	pStream->isRead = isRead;
+	pStream->pBuffer = nullptr;
+	pStream->isPending = false;
+	pStream->isClosing = false;
+	pStream->isEnded = false;
+	pStream->nWriteOffset = 0;
+	pStream->nBacklog = 0;
+
+	if (CreateIoCompletionPort(hFile, m_hPort, reinterpret_cast<ULONG_PTR>(pStream), 0) == nullptr)
+	{
+		delete pStream;
+		return nullptr;
+	}
+
+	pStream->isSkipOnSuccess = SetFileCompletionNotificationModes(hFile, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS) != FALSE;
+	return pStream;
+}
+
+char* QCompletionEngine::AcquireBuffer()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lockBuffers);
+		if (!m_freeBuffers.empty())
+		{
+			char* pBuffer = m_freeBuffers.back();
+			m_freeBuffers.pop_back();
+			return pBuffer;
+		}
+	}
+
+	//Slab exhausted
+	return new char[m_nBufferSize];
+}
+
+void QCompletionEngine::ReleaseBuffer(char* pBuffer)
+{
+	bool isSlab = m_pSlab != nullptr &&
+		pBuffer >= m_pSlab &&
+		pBuffer < m_pSlab + m_nSlabBuffers * m_nBufferSize;
+
+	if (!isSlab)
+	{
+		delete[] pBuffer;
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_lockBuffers);
+	m_freeBuffers.push_back(pBuffer);
+}
+
+void QCompletionEngine::IssueRead(QIoStream* pStream)
+{
+	for (int i = 0; i < kMaxInlineReads; ++i)
+	{
+		{
+			std::lock_guard<std::mutex> lock(pStream->lock);
+			if (pStream->isClosing)
+			{
+				pStream->isPending = false;
+				pStream->cvIdle.notify_all();
+				return;
+			}
+			pStream->isPending = true;
+		}
+
+		ZeroMemory(&pStream->overlapped, sizeof(OVERLAPPED));
+		DWORD dwRead = 0;
+		m_nReadCalls++;
+
+		if (ReadFile(pStream->hFile,
+			pStream->pBuffer,
+			static_cast<DWORD>(m_nBufferSize),
+			&dwRead,
+			&pStream->overlapped))
+		{
+			//Packet is on its way
+			if (!pStream->isSkipOnSuccess) return;
+
+			m_nInlineCompletions++;
+			m_nBytesRead += dwRead;
+			if (dwRead > 0)
+				pStream->onData(pStream->pBuffer, dwRead);
+			continue;
+		}
+
+		if (GetLastError() == ERROR_IO_PENDING) return;
+
+		//ERROR_BROKEN_PIPE: child closed its end
+		EndStream(pStream);
+		return;
+	}
+
+	//Busy stream, let the others have a turn
+	PostQueuedCompletionStatus(m_hPort, 0, reinterpret_cast<ULONG_PTR>(pStream), nullptr);
+}
+
+void QCompletionEngine::IssueWrite(QIoStream* pStream)
+{
+	for (;;)
+	{
+		const char* pData = nullptr;
+		DWORD dwLength = 0;
+		{
+			std::lock_guard<std::mutex> lock(pStream->lock);
+			if (pStream->isClosing || pStream->writes.empty())
+			{
+				pStream->isPending = false;
+				pStream->cvIdle.notify_all();
+				return;
+			}
+
+			const std::string& front = *pStream->writes.front();
+			pData = front.data() + pStream->nWriteOffset;
+			dwLength = static_cast<DWORD>((std::min)(front.size() - pStream->nWriteOffset, kMaxWriteChunk));
+		}
+
+		ZeroMemory(&pStream->overlapped, sizeof(OVERLAPPED));
+		DWORD dwWritten = 0;
+		m_nWriteCalls++;
+
+		if (WriteFile(pStream->hFile, pData, dwLength, &dwWritten, &pStream->overlapped))
+		{
+			if (!pStream->isSkipOnSuccess) return;
+
+			m_nInlineCompletions++;
+			m_nBytesWritten += dwWritten;
+			std::lock_guard<std::mutex> lock(pStream->lock);
+			AdvanceWrites(pStream, dwWritten);
+			continue;
+		}
+
+		if (GetLastError() == ERROR_IO_PENDING) return;
+
+		//Child closed stdin
+		EndStream(pStream);
+		return;
+	}
+}
+
+void QCompletionEngine::OnCompletion(QIoStream* pStream, OVERLAPPED* pOverlapped)
+{
+	//Posted by RegisterRead or a yielding stream
+	if (pOverlapped == nullptr)
+	{
+		if (pStream->isRead)
+			IssueRead(pStream);
+		else
+			IssueWrite(pStream);
+		return;
+	}
+
+	//No wait, the result is already in the OVERLAPPED
+	DWORD dwBytes = 0;
+	BOOL bOK = GetOverlappedResult(pStream->hFile, pOverlapped, &dwBytes, FALSE);
+
+	if (pStream->isRead)
+	{
+		m_nBytesRead += dwBytes;
+		if (dwBytes > 0)
+			pStream->onData(pStream->pBuffer, dwBytes);
+
+		if (!bOK)
+			EndStream(pStream);
+		else
+			IssueRead(pStream);
+		return;
+	}
+
+	m_nBytesWritten += dwBytes;
+	{
+		std::lock_guard<std::mutex> lock(pStream->lock);
+		AdvanceWrites(pStream, dwBytes);
+	}
+
+	if (!bOK)
+		EndStream(pStream);
+	else
+		IssueWrite(pStream);
+}
+
+void QCompletionEngine::EndStream(QIoStream* pStream)
+{
+	//Still pending here, so Unregister can not free the stream under onEnd
+	if (pStream->onEnd)
+		pStream->onEnd();
+
+	std::lock_guard<std::mutex> lock(pStream->lock);
+	pStream->isEnded = true;
+	pStream->isPending = false;
+	pStream->writes.clear();
+	pStream->nWriteOffset = 0;
+	pStream->nBacklog = 0;
+	pStream->cvIdle.notify_all();
+}
+
+void QCompletionEngine::WorkerLoop()
+{
+	OVERLAPPED_ENTRY entries[kCompletionBatch];
+
+	for (;;)
+	{
+		ULONG nEntries = 0;
+		m_nWaitCalls++;
+		if (!GetQueuedCompletionStatusEx(m_hPort, entries, kCompletionBatch, &nEntries, INFINITE, FALSE))
+			break;
+
+		m_nCompletions += nEntries;
+
+		bool bStop = false;
+		for (ULONG i = 0; i < nEntries; ++i)
+		{
+			if (entries[i].lpCompletionKey == kShutdownKey)
+			{
+				bStop = true;
+				continue;
+			}
+
+			OnCompletion(reinterpret_cast<QIoStream*>(entries[i].lpCompletionKey), entries[i].lpOverlapped);
+		}
+
+		if (bStop) break;
+	}
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <Windows.h>
+
+/// <summary>
+/// I/O engine behind QProcess pipes
+/// </summary>
+enum class QIoEngine
+{
+	Polling,		//Reader thread per process, PeekNamedPipe + ReadFile
+	CompletionPort	//Overlapped pipes on a shared I/O completion port
+};
+
+typedef std::function<void(const char* byteData, size_t sizeData)> QIoReadCallback;
+typedef std::function<void()> QIoEndCallback;
+
+typedef struct _QIOENGINESTATS {
+	std::uint64_t nReadCalls;			//ReadFile issued
+	std::uint64_t nWriteCalls;			//WriteFile issued
+	std::uint64_t nWaitCalls;			//GetQueuedCompletionStatusEx
+	std::uint64_t nCompletions;			//Packets dequeued
+	std::uint64_t nInlineCompletions;	//Finished without a packet
+	std::uint64_t nBytesRead;
+	std::uint64_t nBytesWritten;
+}QIOENGINESTATS, *PQIOENGINESTATS;
+
+/// <summary>
+/// One pipe end registered with the engine
+/// </summary>
+struct QIoStream;
+
+/// <summary>
+/// Shared I/O completion port for child pipes.
+/// Every read stream keeps one read in flight on a buffer taken from a
+/// preallocated slab and re-arms it as soon as the callback returns.
+/// Writes to one stream are chained: the next is issued on completion of
+/// the previous. Completions are dequeued in batches.
+/// Reads and writes that finish immediately are handled inline,
+/// without a completion packet
+/// </summary>
+class QCompletionEngine
+{
+public:
+	QCompletionEngine(std::size_t nThreads, std::size_t nBufferSize, std::size_t nBuffers);
+	//Rule of five
+	QCompletionEngine(const QCompletionEngine& other) = delete;
+	const QCompletionEngine operator=(const QCompletionEngine& other) = delete;
+	QCompletionEngine(QCompletionEngine&& other) = delete;
+	const QCompletionEngine operator=(QCompletionEngine&& other) = delete;
+	virtual ~QCompletionEngine();
+
+	/// <summary>
+	/// Process wide engine. nullptr when the port can not be created
+	/// </summary>
+	static QCompletionEngine* Shared();
+
+	bool IsValid() const noexcept;
+
+	/// <summary>
+	/// Overlapped named pipe for a child, random name, current user only.
+	/// Parent end is not inheritable, child end is inheritable and synchronous
+	/// </summary>
+	/// <param name="isParentRead">Parent reads, child writes</param>
+	/// <param name="hParent"></param>
+	/// <param name="hChild"></param>
+	/// <returns>false with last error set</returns>
+	static bool CreateOverlappedPipe(bool isParentRead, HANDLE& hParent, HANDLE& hChild);
+
+	/// <summary>
+	/// Start reading handle (opened with FILE_FLAG_OVERLAPPED).
+	/// onData runs on an engine thread, one call at a time per stream.
+	/// onEnd runs once when the pipe is broken
+	/// </summary>
+	QIoStream* RegisterRead(HANDLE hFile, QIoReadCallback onData, QIoEndCallback onEnd);
+
+	/// <summary>
+	/// Register handle (opened with FILE_FLAG_OVERLAPPED) for Write()
+	/// </summary>
+	QIoStream* RegisterWrite(HANDLE hFile);
+
+	/// <summary>
+	/// Queue data behind earlier writes of the stream
+	/// </summary>
+	/// <returns>false when the stream is closing or broken</returns>
+	bool Write(QIoStream* pStream, std::shared_ptr<const std::string> data);
+
+	/// <summary>
+	/// Bytes queued and not yet written
+	/// </summary>
+	std::size_t GetWriteBacklog(QIoStream* pStream) const;
+
+	/// <summary>
+	/// Cancel outstanding I/O, wait for it and free the stream.
+	/// Must not be called from a callback of the same stream
+	/// </summary>
+	void Unregister(QIoStream* pStream);
+
+	QIOENGINESTATS GetStats() const;
+private:
+	HANDLE m_hPort;
+	std::vector<std::thread> m_threads;
+
+	/// <summary>
+	/// Read buffers, one slab allocated up front
+	/// </summary>
+	const std::size_t m_nBufferSize;
+	char* m_pSlab;
+	std::size_t m_nSlabBuffers;
+	std::mutex m_lockBuffers;
+	std::vector<char*> m_freeBuffers;
+
+	std::atomic<std::uint64_t> m_nReadCalls;
+	std::atomic<std::uint64_t> m_nWriteCalls;
+	std::atomic<std::uint64_t> m_nWaitCalls;
+	std::atomic<std::uint64_t> m_nCompletions;
+	std::atomic<std::uint64_t> m_nInlineCompletions;
+	std::atomic<std::uint64_t> m_nBytesRead;
+	std::atomic<std::uint64_t> m_nBytesWritten;
+private:
+	QIoStream* Associate(HANDLE hFile, bool isRead);
+	char* AcquireBuffer();
+	void ReleaseBuffer(char* pBuffer);
+	void IssueRead(QIoStream* pStream);
+	void IssueWrite(QIoStream* pStream);
+	void OnCompletion(QIoStream* pStream, OVERLAPPED* pOverlapped);
+	void EndStream(QIoStream* pStream);
+	void WorkerLoop();
+};
@@ -0,0 +1,347 @@
+#include "QDispatcher.h"
+#include "Utility.h"
+
+//Chunks delivered by one pool task before it yields the worker
+static constexpr int kPoolDrainBatch = 64;
+
+typedef struct _QSPILLHEADER {
+	std::uint32_t channel;
+	std::uint32_t size;
+}QSPILLHEADER;
+
+static bool WriteAt(HANDLE hFile, std::uint64_t offset, const void* byte, DWORD length)
+{
+	OVERLAPPED ov;
+	ZeroMemory(&ov, sizeof(OVERLAPPED));
+	ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+	ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD dwWritten = 0;
+	return WriteFile(hFile, byte, length, &dwWritten, &ov) && dwWritten == length;
+}
+
+static bool ReadAt(HANDLE hFile, std::uint64_t offset, void* byte, DWORD length)
+{
+	OVERLAPPED ov;
+	ZeroMemory(&ov, sizeof(OVERLAPPED));
+	ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+	ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD dwRead = 0;
+	return ReadFile(hFile, byte, length, &dwRead, &ov) && dwRead == length;
+}
+
+QStreamDispatcher::QStreamDispatcher(processFuncDataOutCallBack outFunc,
+	processFuncDataOutCallBack errFunc,
+	const QDISPATCHCONFIG& config)
+	: m_funcs{ std::move(outFunc), std::move(errFunc) }
+	, m_config(config)
+	, m_nQueueBytes(0)
+	, m_bStopping(false)
+	, m_bScheduled(false)
+	, m_bDelivering(false)
+	, m_nSpillWriteOffset(0)
+	, m_nSpillReadOffset(0)
+	, m_nSpillChunks(0)
+	, m_nSpillBytes(0)
+	, m_metrics{}
+{
+	//A dispatcher of a stream without callback never gets a chunk
+	if (m_config.mode == QDispatchMode::DedicatedThread &&
+		(m_funcs[ChannelOut] != nullptr || m_funcs[ChannelErr] != nullptr))
+		m_threadConsumer = std::thread([this]() { ConsumerLoop(); });
+}
+
+QStreamDispatcher::~QStreamDispatcher()
+{
+	Stop();
+}
+
+void QStreamDispatcher::Dispatch(Channel channel, const char* byteData, size_t sizeData)
+{
+	if (m_funcs[channel] == nullptr) return;
+
+	if (m_config.mode == QDispatchMode::Inline)
+	{
+		m_funcs[channel](byteData, sizeData);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(m_lock);
+	if (m_bStopping) return;
+
+	m_metrics.nEnqueuedChunks++;
+
+	bool bQueued = false;
+
+	//Keep order: once on disk, stay on disk until drained.
+	//If that fails the chunk is dropped, in memory it would overtake the spilled ones
+	if (m_nSpillChunks > 0)
+	{
+		if (!SpillWrite(channel, byteData, sizeData))
+		{
+			m_metrics.nDroppedChunks++;
+			m_metrics.nDroppedBytes += sizeData;
+			return;
+		}
+		bQueued = true;
+	}
+
+	if (!bQueued &&
+		!m_queue.empty() &&
+		m_nQueueBytes + sizeData > m_config.maxQueueBytes)
+	{
+		switch (m_config.overflowPolicy)
+		{
+		case QOverflowPolicy::Block:
+			m_metrics.nBlockedCount++;
+			m_cvSpace.wait(lock, [this, sizeData]() {
+				return m_bStopping ||
+					m_queue.empty() ||
+					m_nQueueBytes + sizeData <= m_config.maxQueueBytes;
+			});
+			break;
+		case QOverflowPolicy::DropOldest:
+			while (!m_queue.empty() &&
+				m_nQueueBytes + sizeData > m_config.maxQueueBytes)
+			{
+				m_metrics.nDroppedChunks++;
+				m_metrics.nDroppedBytes += m_queue.front().data.size();
+				m_nQueueBytes -= m_queue.front().data.size();
+				m_queue.pop_front();
+			}
+			break;
+		case QOverflowPolicy::SpillToDisk:
+			//On failure keep it in memory, over budget. Nothing is on disk to overtake
+			bQueued = SpillWrite(channel, byteData, sizeData);
+			break;
+		}
+	}
+
+	if (!bQueued)
+	{
+		m_queue.push_back(Chunk{ channel, std::vector<char>(byteData, byteData + sizeData) });
+		m_nQueueBytes += sizeData;
+	}
+
+	UpdateDepthLocked();
+
+	if (m_config.mode == QDispatchMode::DedicatedThread)
+	{
+		lock.unlock();
+		m_cvData.notify_one();
+		return;
+	}
+
+	//Shared pool: one drain task at a time keeps the order
+	if (!m_bScheduled)
+	{
+		m_bScheduled = true;
+		lock.unlock();
+		QThreadPool::Shared().Submit([this]() { DrainOnPool(); });
+	}
+}
+
+void QStreamDispatcher::Stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		if (m_bStopping) return;
+
+		m_cvIdle.wait(lock, [this]() {
+			return m_queue.empty() &&
+				m_nSpillChunks == 0 &&
+				!m_bScheduled &&
+				!m_bDelivering;
+		});
+		m_bStopping = true;
+	}
+
+	m_cvData.notify_all();
+	m_cvSpace.notify_all();
+
+	if (m_threadConsumer.joinable())
+		m_threadConsumer.join();
+
+	m_hSpillFile.Close();
+	m_hSpillFile.Detach();
+}
+
+QQUEUEMETRICS QStreamDispatcher::GetMetrics() const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_metrics;
+}
+
+bool QStreamDispatcher::SpillWrite(Channel channel, const char* byteData, size_t sizeData)
+{
+	if (m_hSpillFile() == INVALID_HANDLE_VALUE)
+	{
+		TCHAR szTempPath[MAX_PATH];
+		TCHAR szTempFile[MAX_PATH];
+
+		if (!GetTempPath(MAX_PATH, szTempPath) ||
+			!GetTempFileName(szTempPath, TEXT("qpw"), 0, szTempFile))
+		{
+			PrintError("GetTempFileName");
+			return false;
+		}
+
+		//Removed by the system when the handle is closed
+		HANDLE hFile = CreateFile(szTempFile,
+			GENERIC_READ | GENERIC_WRITE,
+			0,
+			nullptr,
+			CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+			nullptr);
+
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			PrintError("CreateFile");
+			return false;
+		}
+		m_hSpillFile.Set(hFile);
+	}
+
+	QSPILLHEADER header;
+	header.channel = channel;
+	header.size = static_cast<std::uint32_t>(sizeData);
+
+	if (!WriteAt(m_hSpillFile(), m_nSpillWriteOffset, &header, sizeof(header)) ||
+		!WriteAt(m_hSpillFile(), m_nSpillWriteOffset + sizeof(header), byteData, header.size))
+	{
+		PrintError("WriteFile");
+		return false;
+	}
+
+	m_nSpillWriteOffset += sizeof(header) + sizeData;
+	m_nSpillChunks++;
+	m_nSpillBytes += sizeData;
+	m_metrics.nSpilledBytes += sizeData;
+	return true;
+}
+
+bool QStreamDispatcher::SpillRead(Chunk& chunk)
+{
+	QSPILLHEADER header;
+	bool bOK = ReadAt(m_hSpillFile(), m_nSpillReadOffset, &header, sizeof(header));
+	if (bOK)
+	{
+		chunk.channel = static_cast<Channel>(header.channel);
+		chunk.data.resize(header.size);
+		bOK = ReadAt(m_hSpillFile(), m_nSpillReadOffset + sizeof(header), chunk.data.data(), header.size);
+	}
+
+	if (!bOK)
+	{
+		//File is unusable. Count what is left as dropped and start over
+		PrintError("ReadFile");
+		m_metrics.nDroppedChunks += m_nSpillChunks;
+		m_metrics.nDroppedBytes += m_nSpillBytes;
+		m_nSpillChunks = 0;
+		m_nSpillBytes = 0;
+		m_nSpillReadOffset = 0;
+		m_nSpillWriteOffset = 0;
+		return false;
+	}
+
+	m_nSpillReadOffset += sizeof(header) + header.size;
+	m_nSpillChunks--;
+	m_nSpillBytes -= header.size;
+
+	//Drained, reuse the file from the start
+	if (m_nSpillChunks == 0)
+	{
+		m_nSpillReadOffset = 0;
+		m_nSpillWriteOffset = 0;
+	}
+	return true;
+}
+
+bool QStreamDispatcher::PopLocked(Chunk& chunk)
+{
+	if (!m_queue.empty())
+	{
+		chunk = std::move(m_queue.front());
+		m_queue.pop_front();
+		m_nQueueBytes -= chunk.data.size();
+	}
+	else if (m_nSpillChunks == 0 || !SpillRead(chunk))
+	{
+		return false;
+	}
+
+	UpdateDepthLocked();
+	m_cvSpace.notify_one();
+	return true;
+}
+
+void QStreamDispatcher::Deliver(const Chunk& chunk)
+{
+	m_funcs[chunk.channel](chunk.data.data(), chunk.data.size());
+}
+
+void QStreamDispatcher::UpdateDepthLocked()
+{
+	m_metrics.nDepthChunks = m_queue.size() + m_nSpillChunks;
+	m_metrics.nDepthBytes = m_nQueueBytes + m_nSpillBytes;
+	if (m_metrics.nDepthBytes > m_metrics.nHighWaterBytes)
+		m_metrics.nHighWaterBytes = m_metrics.nDepthBytes;
+}
+
+void QStreamDispatcher::ConsumerLoop()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+
+	for (;;)
+	{
+		Chunk chunk;
+		if (PopLocked(chunk))
+		{
+			m_bDelivering = true;
+			lock.unlock();
+			Deliver(chunk);
+			lock.lock();
+			m_bDelivering = false;
+			m_metrics.nDeliveredChunks++;
+			continue;
+		}
+
+		m_cvIdle.notify_all();
+		if (m_bStopping) break;
+
+		m_cvData.wait(lock, [this]() {
+			return m_bStopping ||
+				!m_queue.empty() ||
+				m_nSpillChunks > 0;
+		});
+	}
+}
+
+void QStreamDispatcher::DrainOnPool()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+
+	for (int i = 0; i < kPoolDrainBatch; ++i)
+	{
+		Chunk chunk;
+		if (!PopLocked(chunk))
+		{
+			m_bScheduled = false;
+			m_cvIdle.notify_all();
+			return;
+		}
+
+		m_bDelivering = true;
+		lock.unlock();
+		Deliver(chunk);
+		lock.lock();
+		m_bDelivering = false;
+		m_metrics.nDeliveredChunks++;
+	}
+
+	//Still busy. Behind the tasks already waiting on this worker, so other processes get a turn
+	lock.unlock();
+	QThreadPool::Shared().Requeue([this]() { DrainOnPool(); });
+}
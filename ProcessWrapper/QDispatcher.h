@@ -0,0 +1,155 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <cstdint>
+#include <Windows.h>
+#include "QHandle.h"
+#include "QThreadPool.h"
+
+typedef std::function<void(const char* byteData, const size_t& sizeData)> processFuncDataOutCallBack;
+
+/// <summary>
+/// Where output callbacks run
+/// </summary>
+enum class QDispatchMode
+{
+	Inline,				//On the reader thread, inside Read()
+	DedicatedThread,	//One consumer thread per dispatcher
+	SharedPool			//QThreadPool::Shared(), serialized per dispatcher
+};
+
+/// <summary>
+/// What the reader does when the queue is full
+/// </summary>
+enum class QOverflowPolicy
+{
+	Block,			//Stop draining the pipe until the consumer catches up. SpillToDisk with QIoEngine::CompletionPort
+	DropOldest,		//Discard the oldest queued chunks
+	SpillToDisk		//Append to a temporary file, delivered in order later. Dropped when the file fails
+};
+
+/// <summary>
+/// Ordering between stdout and stderr callbacks
+/// </summary>
+enum class QDispatchOrdering
+{
+	PerStream,		//Independent queue per stream
+	PerProcess		//One queue, callbacks follow pipe read order
+};
+
+typedef struct _QDISPATCHCONFIG {
+	QDispatchMode mode;
+	QOverflowPolicy overflowPolicy;
+	QDispatchOrdering ordering;
+	std::size_t maxQueueBytes;
+
+public:
+	_QDISPATCHCONFIG(QDispatchMode mode = QDispatchMode::Inline,
+		QOverflowPolicy overflowPolicy = QOverflowPolicy::Block,
+		QDispatchOrdering ordering = QDispatchOrdering::PerStream,
+		std::size_t maxQueueBytes = 1024 * 1024)
+		: mode(mode)
+		, overflowPolicy(overflowPolicy)
+		, ordering(ordering)
+		, maxQueueBytes(maxQueueBytes)
+	{
+	}
+}QDISPATCHCONFIG, *PQDISPATCHCONFIG;
+
+typedef struct _QQUEUEMETRICS {
+	std::uint64_t nDepthChunks;		//Chunks waiting in memory and on disk
+	std::uint64_t nDepthBytes;		//Bytes waiting in memory and on disk
+	std::uint64_t nHighWaterBytes;	//Peak of nDepthBytes
+	std::uint64_t nEnqueuedChunks;
+	std::uint64_t nDeliveredChunks;
+	std::uint64_t nDroppedChunks;
+	std::uint64_t nDroppedBytes;
+	std::uint64_t nSpilledBytes;
+	std::uint64_t nBlockedCount;	//Times the reader waited for space
+}QQUEUEMETRICS, *PQQUEUEMETRICS;
+
+/// <summary>
+/// Bounded queue between the pipe reader and the output callbacks.
+/// Carries up to two channels (stdout, stderr) so one instance can
+/// keep the read order of both streams.
+/// </summary>
+class QStreamDispatcher
+{
+public:
+	enum Channel : std::uint32_t
+	{
+		ChannelOut = 0,
+		ChannelErr = 1
+	};
+
+	QStreamDispatcher(processFuncDataOutCallBack outFunc,
+		processFuncDataOutCallBack errFunc,
+		const QDISPATCHCONFIG& config);
+	//Rule of five
+	QStreamDispatcher(const QStreamDispatcher& other) = delete;
+	const QStreamDispatcher operator=(const QStreamDispatcher& other) = delete;
+	QStreamDispatcher(QStreamDispatcher&& other) = delete;
+	const QStreamDispatcher operator=(QStreamDispatcher&& other) = delete;
+	virtual ~QStreamDispatcher();
+
+	/// <summary>
+	/// Hand one chunk to the callback of channel. Called by the reader
+	/// </summary>
+	/// <param name="channel"></param>
+	/// <param name="byteData"></param>
+	/// <param name="sizeData"></param>
+	void Dispatch(Channel channel, const char* byteData, size_t sizeData);
+
+	/// <summary>
+	/// Deliver everything queued, then stop the consumer
+	/// </summary>
+	void Stop();
+
+	QQUEUEMETRICS GetMetrics() const;
+private:
+	struct Chunk
+	{
+		Channel channel;
+		std::vector<char> data;
+	};
+
+	processFuncDataOutCallBack m_funcs[2];
+	const QDISPATCHCONFIG m_config;
+
+	mutable std::mutex m_lock;
+	std::condition_variable m_cvData;	//Consumer waits for chunk
+	std::condition_variable m_cvSpace;	//Reader waits for space
+	std::condition_variable m_cvIdle;	//Stop waits for empty queue
+
+	std::deque<Chunk> m_queue;
+	std::size_t m_nQueueBytes;
+	bool m_bStopping;
+	bool m_bScheduled;		//Pool drain task in flight
+	bool m_bDelivering;		//Callback running outside the lock
+
+	/// <summary>
+	/// Spill file. Records are [Channel][size][bytes], read back in order.
+	/// Once spilling starts new chunks go to disk until it is drained
+	/// </summary>
+	QHandle m_hSpillFile;
+	std::uint64_t m_nSpillWriteOffset;
+	std::uint64_t m_nSpillReadOffset;
+	std::uint64_t m_nSpillChunks;
+	std::uint64_t m_nSpillBytes;
+
+	QQUEUEMETRICS m_metrics;
+	std::thread m_threadConsumer;
+private:
+	bool SpillWrite(Channel channel, const char* byteData, size_t sizeData);
+	bool SpillRead(Chunk& chunk);
+	bool PopLocked(Chunk& chunk);
+	void Deliver(const Chunk& chunk);
+	void UpdateDepthLocked();
+	void ConsumerLoop();
+	void DrainOnPool();
+};
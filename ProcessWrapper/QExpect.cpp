@@ -0,0 +1,296 @@
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include "QExpect.h"
+
+static constexpr std::int32_t kRootState = 0;
+static constexpr std::int32_t kNoState = -1;
+static constexpr int kNoPattern = -1;
+
+//Lower index wins when two patterns end at the same byte
+static int PreferPattern(int nLeft, int nRight)
+{
+	if (nLeft == kNoPattern) return nRight;
+	if (nRight == kNoPattern) return nLeft;
+	return (std::min)(nLeft, nRight);
+}
+
+QExpectMatcher::QExpectMatcher(std::size_t nMaxBuffer)
+	: m_nClasses(1)
+	, m_nMaxLiteral(0)
+	, m_nScanned(0)
+	, m_nState(kRootState)
+	, m_nMaxBuffer(nMaxBuffer)
+	, m_nMatchIndex(kNoPattern)
+	, m_nMatchStart(0)
+	, m_nMatchEnd(0)
+{
+	std::memset(m_byteClass, 0, sizeof(m_byteClass));
+}
+
+bool QExpectMatcher::Compile(const std::vector<QEXPECTPATTERN>& patterns)
+{
+	std::memset(m_byteClass, 0, sizeof(m_byteClass));
+	m_nClasses = 1;
+	m_transitions.clear();
+	m_output.clear();
+	m_literalLength.assign(patterns.size(), 0);
+	m_nMaxLiteral = 0;
+	m_regexes.clear();
+
+	bool bOK = true;
+
+	//Byte classes
+	for (const QEXPECTPATTERN& pattern : patterns)
+	{
+		if (pattern.isRegex) continue;
+		for (unsigned char byte : pattern.strPattern)
+		{
+			if (m_byteClass[byte] == 0)
+				m_byteClass[byte] = static_cast<std::uint8_t>(m_nClasses++);
+		}
+	}
+
+	//Trie
+	m_transitions.assign(m_nClasses, kNoState);
+	m_output.assign(1, kNoPattern);
+
+	for (std::size_t i = 0; i < patterns.size(); ++i)
+	{
+		const QEXPECTPATTERN& pattern = patterns[i];
+
+		if (pattern.isRegex)
+		{
+			try
+			{
+				m_regexes.emplace_back(static_cast<int>(i), std::regex(pattern.strPattern));
+			}
+			catch (const std::regex_error&)
+			{
+				bOK = false;
+			}
+			continue;
+		}
+
+		if (pattern.strPattern.empty()) continue;
+
+		std::int32_t state = kRootState;
+		for (unsigned char byte : pattern.strPattern)
+		{
+			std::size_t slot = state * m_nClasses + m_byteClass[byte];
+			if (m_transitions[slot] == kNoState)
+			{
+				m_transitions[slot] = static_cast<std::int32_t>(m_output.size());
+				m_transitions.resize(m_transitions.size() + m_nClasses, kNoState);
+				m_output.push_back(kNoPattern);
+			}
+			state = m_transitions[slot];
+		}
+
+		m_output[state] = PreferPattern(m_output[state], static_cast<int>(i));
+		m_literalLength[i] = pattern.strPattern.size();
+		m_nMaxLiteral = (std::max)(m_nMaxLiteral, pattern.strPattern.size());
+	}
+
+	//Failure links, folded into a full transition table (breadth first)
+	std::vector<std::int32_t> failure(m_output.size(), kRootState);
+	std::deque<std::int32_t> queue;
+
+	for (std::size_t c = 0; c < m_nClasses; ++c)
+	{
+		std::int32_t& next = m_transitions[c];
+		if (next == kNoState)
+		{
+			next = kRootState;
+			continue;
+		}
+		failure[next] = kRootState;
+		queue.push_back(next);
+	}
+
+	while (!queue.empty())
+	{
+		std::int32_t state = queue.front();
+		queue.pop_front();
+
+		m_output[state] = PreferPattern(m_output[state], m_output[failure[state]]);
+
+		for (std::size_t c = 0; c < m_nClasses; ++c)
+		{
+			std::int32_t& next = m_transitions[state * m_nClasses + c];
+			std::int32_t fallback = m_transitions[failure[state] * m_nClasses + c];
+			if (next == kNoState)
+			{
+				next = fallback;
+				continue;
+			}
+			failure[next] = fallback;
+			queue.push_back(next);
+		}
+	}
+
+	//New patterns, the pending text has to be looked at again
+	ResetScan();
+	Scan();
+	SearchRegex();
+	return bOK;
+}
+
+void QExpectMatcher::Feed(const char* byteData, size_t sizeData)
+{
+	m_strBuffer.append(byteData, sizeData);
+
+	if (!HasMatch())
+	{
+		Scan();
+		SearchRegex();
+	}
+
+	Trim();
+}
+
+bool QExpectMatcher::HasMatch() const noexcept
+{
+	return m_nMatchIndex != kNoPattern;
+}
+
+QEXPECTRESULT QExpectMatcher::TakeMatch()
+{
+	QEXPECTRESULT result;
+	result.nIndex = m_nMatchIndex;
+	result.isTimeout = false;
+	result.isEof = false;
+
+	if (!HasMatch()) return result;
+
+	result.strBefore = m_strBuffer.substr(0, m_nMatchStart);
+	result.strMatch = m_strBuffer.substr(m_nMatchStart, m_nMatchEnd - m_nMatchStart);
+	m_strBuffer.erase(0, m_nMatchEnd);
+
+	//Text after the match may already hold the next one
+	ResetScan();
+	Scan();
+	SearchRegex();
+	return result;
+}
+
+const std::string& QExpectMatcher::Pending() const noexcept
+{
+	return m_strBuffer;
+}
+
+std::string QExpectMatcher::TakePending()
+{
+	std::string strPending = std::move(m_strBuffer);
+	m_strBuffer.clear();
+	ResetScan();
+	return strPending;
+}
+
+void QExpectMatcher::Scan()
+{
+	if (HasMatch()) return;
+
+	const std::size_t size = m_strBuffer.size();
+	if (m_nMaxLiteral == 0)
+	{
+		m_nScanned = size;
+		return;
+	}
+
+	const unsigned char* byte = reinterpret_cast<const unsigned char*>(m_strBuffer.data());
+	std::int32_t state = m_nState;
+
+	for (std::size_t i = m_nScanned; i < size; ++i)
+	{
+		state = m_transitions[state * m_nClasses + m_byteClass[byte[i]]];
+
+		int nPattern = m_output[state];
+		if (nPattern != kNoPattern)
+		{
+			m_nState = state;
+			m_nScanned = i + 1;
+			m_nMatchIndex = nPattern;
+			m_nMatchEnd = i + 1;
+			m_nMatchStart = m_nMatchEnd - m_literalLength[nPattern];
+			return;
+		}
+	}
+
+	m_nState = state;
+	m_nScanned = size;
+}
+
+void QExpectMatcher::SearchRegex()
+{
+	if (m_regexes.empty()) return;
+
+	//Only a regex match ending before the literal one can win
+	const char* begin = m_strBuffer.data();
+	const char* end = begin + (HasMatch() ? m_nMatchEnd : m_strBuffer.size());
+
+	for (const auto& [nIndex, regex] : m_regexes)
+	{
+		std::cmatch match;
+		if (!std::regex_search(begin, end, match, regex)) continue;
+
+		std::size_t nStart = static_cast<std::size_t>(match.position(0));
+		std::size_t nEnd = nStart + static_cast<std::size_t>(match.length(0));
+
+		if (!HasMatch() ||
+			nEnd < m_nMatchEnd ||
+			(nEnd == m_nMatchEnd && nIndex < m_nMatchIndex))
+		{
+			m_nMatchIndex = nIndex;
+			m_nMatchStart = nStart;
+			m_nMatchEnd = nEnd;
+			end = begin + nEnd;
+		}
+	}
+}
+
+void QExpectMatcher::Trim()
+{
+	while (m_strBuffer.size() > m_nMaxBuffer)
+	{
+		if (!HasMatch())
+		{
+			//Fully scanned. Automaton state does not depend on the buffer
+			std::size_t nKeep = (std::max)(m_nMaxBuffer, m_nMaxLiteral);
+			if (m_strBuffer.size() <= nKeep) return;
+
+			std::size_t nCut = m_strBuffer.size() - nKeep;
+			m_strBuffer.erase(0, nCut);
+			m_nScanned -= nCut;
+			return;
+		}
+
+		//Text before the match is only kept for strBefore
+		std::size_t nCut = (std::min)(m_nMatchStart, m_strBuffer.size() - m_nMaxBuffer);
+		if (nCut > 0)
+		{
+			m_strBuffer.erase(0, nCut);
+			m_nScanned -= nCut;
+			m_nMatchStart -= nCut;
+			m_nMatchEnd -= nCut;
+		}
+
+		if (m_strBuffer.size() - m_nMatchEnd <= m_nMaxBuffer)
+			return;
+
+		//Nobody takes the match while output keeps coming. Drop it
+		m_strBuffer.erase(0, m_nMatchEnd);
+		ResetScan();
+		Scan();
+		SearchRegex();
+	}
+}
+
+void QExpectMatcher::ResetScan() noexcept
+{
+	m_nScanned = 0;
+	m_nState = kRootState;
+	m_nMatchIndex = kNoPattern;
+	m_nMatchStart = 0;
+	m_nMatchEnd = 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <regex>
+#include <cstdint>
+
+typedef struct _QEXPECTPATTERN {
+	std::string strPattern;
+	bool isRegex;
+
+public:
+	_QEXPECTPATTERN(std::string pattern, bool isRegex = false)
+		: strPattern(std::move(pattern))
+		, isRegex(isRegex)
+	{
+	}
+	_QEXPECTPATTERN(const char* pattern, bool isRegex = false)
+		: strPattern(pattern)
+		, isRegex(isRegex)
+	{
+	}
+}QEXPECTPATTERN, *PQEXPECTPATTERN;
+
+typedef struct _QEXPECTRESULT {
+	int nIndex;				//Index of matched pattern, -1 on timeout or end of output
+	std::string strBefore;	//Text before the match
+	std::string strMatch;	//Matched text
+	bool isTimeout;
+	bool isEof;
+}QEXPECTRESULT, *PQEXPECTRESULT;
+
+/// <summary>
+/// Streaming multi-pattern matcher.
+/// Literal patterns are compiled into one Aho-Corasick automaton and every
+/// byte is scanned once, whatever chunk it arrives in.
+/// Regex patterns are searched on the pending text after each feed
+/// </summary>
+class QExpectMatcher
+{
+public:
+	explicit QExpectMatcher(std::size_t nMaxBuffer = 64 * 1024);
+
+	/// <summary>
+	/// Replace patterns. Pending text not consumed yet is scanned again
+	/// </summary>
+	/// <param name="patterns"></param>
+	/// <returns>false when a regex pattern is invalid, it is skipped</returns>
+	bool Compile(const std::vector<QEXPECTPATTERN>& patterns);
+
+	/// <summary>
+	/// Append output and advance the automaton. Stops at first match
+	/// </summary>
+	/// <param name="byteData"></param>
+	/// <param name="sizeData"></param>
+	void Feed(const char* byteData, size_t sizeData);
+
+	bool HasMatch() const noexcept;
+
+	/// <summary>
+	/// Pop the match and the text before it
+	/// </summary>
+	QEXPECTRESULT TakeMatch();
+
+	/// <summary>
+	/// Pending text, nothing consumed
+	/// </summary>
+	const std::string& Pending() const noexcept;
+
+	/// <summary>
+	/// Pop everything pending
+	/// </summary>
+	std::string TakePending();
+private:
+	/// <summary>
+	/// Automaton over byte classes. Only bytes used in patterns get own class,
+	/// everything else shares class 0
+	/// </summary>
+	std::uint8_t m_byteClass[256];
+	std::size_t m_nClasses;
+	std::vector<std::int32_t> m_transitions;	//state * m_nClasses + class
+	std::vector<std::int32_t> m_output;			//Pattern ending at state, -1 if none
+	std::vector<std::size_t> m_literalLength;	//By pattern index
+	std::size_t m_nMaxLiteral;
+
+	std::vector<std::pair<int, std::regex>> m_regexes;
+
+	std::string m_strBuffer;
+	std::size_t m_nScanned;		//Bytes of m_strBuffer already through the automaton
+	std::int32_t m_nState;
+	const std::size_t m_nMaxBuffer;
+
+	//Pending match, offsets in m_strBuffer
+	int m_nMatchIndex;
+	std::size_t m_nMatchStart;
+	std::size_t m_nMatchEnd;
+private:
+	void Scan();
+	void SearchRegex();
+	void Trim();
+	void ResetScan() noexcept;
+};
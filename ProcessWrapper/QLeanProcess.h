@@ -0,0 +1,463 @@
+#pragma once
+#include <string>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <Windows.h>
+#include "QHandle.h"
+#include "QDispatcher.h"
+#include "QCompletionEngine.h"
+#include "QChildProcess.h"
+#include "Utility.h"
+
+//MSVC ignores the standard attribute
+#ifdef _MSC_VER
+#define Q_NO_UNIQUE_ADDRESS [[msvc::no_unique_address]]
+#else
+#define Q_NO_UNIQUE_ADDRESS [[no_unique_address]]
+#endif
+
+/// <summary>
+/// Policy categories of QLeanProcess
+/// </summary>
+struct QRedirectPolicy {};
+struct QCallbackPolicy {};
+struct QCharPolicy {};
+struct QEnginePolicy {};
+
+/// <summary>
+/// Pipes to create. A stream not redirected has no handle, thread or callback
+/// </summary>
+template<bool isOut, bool isErr, bool isIn>
+struct QRedirect : QRedirectPolicy
+{
+	static constexpr bool isStdOut = isOut;
+	static constexpr bool isStdErr = isErr;
+	static constexpr bool isStdIn = isIn;
+};
+
+typedef QRedirect<true, true, true> QRedirectAll;
+typedef QRedirect<true, false, false> QRedirectStdOut;
+typedef QRedirect<true, false, true> QRedirectStdOutIn;
+
+/// <summary>
+/// Callback for a stream that needs none
+/// </summary>
+struct QNoCallback
+{
+	void operator()(const char*, const size_t&) const noexcept {}
+};
+
+/// <summary>
+/// Callback types: std::function, function reference or pointer, or a lambda type.
+/// Called directly, type erased only when the type is
+/// </summary>
+template<typename OutFunc, typename ErrFunc = QNoCallback>
+struct QCallback : QCallbackPolicy
+{
+	typedef OutFunc OutType;
+	typedef ErrFunc ErrType;
+};
+
+typedef QCallback<processFuncDataOutCallBack, processFuncDataOutCallBack> QFunctionCallback;
+
+/// <summary>
+/// Character type of command line and directory. Picks CreateProcessA or CreateProcessW
+/// </summary>
+template<typename CharT>
+struct QChar : QCharPolicy
+{
+	typedef CharT CharType;
+};
+
+/// <summary>
+/// Polling: blocking reader thread per stream. CompletionPort: shared QCompletionEngine
+/// </summary>
+template<QIoEngine engine>
+struct QEngine : QEnginePolicy
+{
+	static constexpr QIoEngine value = engine;
+};
+
+/// <summary>
+/// First policy of the category, or the default
+/// </summary>
+template<typename Category, typename Default, typename... Policies>
+struct QSelectPolicy
+{
+	typedef Default type;
+};
+
+template<typename Category, typename Default, typename First, typename... Rest>
+struct QSelectPolicy<Category, Default, First, Rest...>
+{
+	typedef std::conditional_t<std::is_base_of_v<Category, First>,
+		First,
+		typename QSelectPolicy<Category, Default, Rest...>::type> type;
+};
+
+/// <summary>
+/// Member left out by a policy. Distinct ids so they take no space together
+/// </summary>
+template<int nId>
+struct QNone
+{
+};
+
+/// <summary>
+/// Process configured at compile time.
+/// Only the redirected pipes exist, with their handle, reader and callback,
+/// and callbacks are invoked directly on the read buffer.
+/// Policies not given take the default: QRedirectAll, QFunctionCallback,
+/// QChar&lt;TCHAR&gt;, QEngine&lt;QIoEngine::Polling&gt;.
+/// No dispatcher, Expect, pseudo console, watchdog or retention, use QProcess for those.
+/// Both create and kill children through QChildProcess
+/// </summary>
+template<typename... Policies>
+class QLeanProcess
+{
+	typedef typename QSelectPolicy<QRedirectPolicy, QRedirectAll, Policies...>::type Redirect;
+	typedef typename QSelectPolicy<QCallbackPolicy, QFunctionCallback, Policies...>::type Callback;
+	typedef typename QSelectPolicy<QCharPolicy, QChar<TCHAR>, Policies...>::type Char;
+
+	static constexpr bool kIsStdOut = Redirect::isStdOut;
+	static constexpr bool kIsStdErr = Redirect::isStdErr;
+	static constexpr bool kIsStdIn = Redirect::isStdIn;
+	static constexpr bool kIsPort = QSelectPolicy<QEnginePolicy, QEngine<QIoEngine::Polling>, Policies...>::type::value == QIoEngine::CompletionPort;
+public:
+	typedef typename Callback::OutType OutFunc;
+	typedef typename Callback::ErrType ErrFunc;
+	typedef typename Char::CharType CharType;
+	typedef std::basic_string<CharType> StringType;
+
+	/// <param name="strFileName">Command line</param>
+	/// <param name="funcOut"></param>
+	/// <param name="funcErr"></param>
+	/// <param name="strCurrentDirectory">Empty for the current one</param>
+	/// <param name="strEnvironment">Block of NUL separated entries, empty to inherit</param>
+	/// <param name="isCreateNoWindow"></param>
+	QLeanProcess(StringType strFileName,
+		OutFunc funcOut = OutFunc(),
+		ErrFunc funcErr = ErrFunc(),
+		StringType strCurrentDirectory = StringType(),
+		StringType strEnvironment = StringType(),
+		bool isCreateNoWindow = true)
+		: m_funcOut(Keep<FuncOutMember>(std::forward<OutFunc>(funcOut)))
+		, m_funcErr(Keep<FuncErrMember>(std::forward<ErrFunc>(funcErr)))
+		, m_hChildProcess(INVALID_HANDLE_VALUE)
+		, m_dwChildProcessID(0)
+		, m_bIsClosed(false)
+	{
+		Open(std::move(strFileName), std::move(strCurrentDirectory), std::move(strEnvironment), isCreateNoWindow);
+	}
+	//Rule of five
+	QLeanProcess(const QLeanProcess& other) = delete;
+	const QLeanProcess operator=(const QLeanProcess& other) = delete;
+	QLeanProcess(QLeanProcess&& other) = delete;
+	const QLeanProcess operator=(QLeanProcess&& other) = delete;
+	//Not virtual, no vtable pointer in the object
+	~QLeanProcess()
+	{
+		Close();
+	}
+
+	/// <summary>
+	/// Write bytes to process as is
+	/// </summary>
+	bool WriteData(const char* byte, const size_t& length) requires (kIsStdIn)
+	{
+		if constexpr (kIsPort)
+		{
+			if (m_pStreamIn == nullptr) return false;
+			return QCompletionEngine::Shared()->Write(m_pStreamIn, std::make_shared<const std::string>(byte, length));
+		}
+		else
+		{
+			DWORD dwWritten = 0;
+			if (!WriteFile(m_hStdinWrite(), byte, static_cast<DWORD>(length), &dwWritten, nullptr))
+			{
+				PrintError("WriteFile");
+				return false;
+			}
+			return true;
+		}
+	}
+
+	/// <summary>
+	/// Write line to process
+	/// </summary>
+	bool WriteCommand(const std::string& strCommand) requires (kIsStdIn)
+	{
+		std::string newCommand = strCommand + "\r\n";
+		return WriteData(newCommand.c_str(), newCommand.size());
+	}
+
+	/// <summary>
+	/// Wait for child process to exit
+	/// </summary>
+	/// <param name="dwTimeoutMs">INFINITE to wait forever</param>
+	/// <returns>true when child process ended</returns>
+	bool WaitForExit(DWORD dwTimeoutMs) const
+	{
+		if (m_hChildProcess == INVALID_HANDLE_VALUE) return true;
+		return WaitForSingleObject(m_hChildProcess, dwTimeoutMs) == WAIT_OBJECT_0;
+	}
+
+	/// <summary>
+	/// Terminate child process and the processes it started
+	/// </summary>
+	void Kill() const
+	{
+		if (m_hChildProcess != INVALID_HANDLE_VALUE && !m_bIsClosed)
+			QChildProcess::KillTree(m_dwChildProcessID, m_hChildProcess);
+	}
+
+	DWORD GetProcessId() const noexcept
+	{
+		return m_dwChildProcessID;
+	}
+
+	/// <summary>
+	/// Hand one chunk to the stored callback, as the reader does for every read
+	/// </summary>
+	void DispatchStdOut(const char* byteData, size_t sizeData) requires (kIsStdOut)
+	{
+		m_funcOut(byteData, sizeData);
+	}
+
+	void DispatchStdErr(const char* byteData, size_t sizeData) requires (kIsStdErr)
+	{
+		m_funcErr(byteData, sizeData);
+	}
+
+	/// <summary>
+	/// Stop readers and close pipes. Output still in a pipe of a running child is lost
+	/// </summary>
+	void Close()
+	{
+		if (m_bIsClosed) return;
+		m_bIsClosed = true;
+
+		if constexpr (kIsPort)
+		{
+			if constexpr (kIsStdOut) QCompletionEngine::Shared()->Unregister(m_pStreamOut);
+			if constexpr (kIsStdErr) QCompletionEngine::Shared()->Unregister(m_pStreamErr);
+			if constexpr (kIsStdIn) QCompletionEngine::Shared()->Unregister(m_pStreamIn);
+		}
+		else
+		{
+			//Ended child: readers drain the pipe and stop on their own
+			bool isDrain = WaitForExit(0);
+			if constexpr (kIsStdOut) StopReader(m_readerOut, isDrain);
+			if constexpr (kIsStdErr) StopReader(m_readerErr, isDrain);
+		}
+
+		if constexpr (kIsStdOut) m_hStdoutRead.Close();
+		if constexpr (kIsStdErr) m_hStdErrRead.Close();
+		if constexpr (kIsStdIn) m_hStdinWrite.Close();
+
+		if (m_hChildProcess != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hChildProcess);
+		m_hChildProcess = INVALID_HANDLE_VALUE;
+	}
+private:
+	/// <summary>
+	/// Blocking reader of one pipe
+	/// </summary>
+	struct QReader
+	{
+		std::thread thread;
+		std::atomic_bool isExited = false;
+	};
+
+	typedef std::conditional_t<kIsStdOut, OutFunc, QNone<0>> FuncOutMember;
+	typedef std::conditional_t<kIsStdErr, ErrFunc, QNone<1>> FuncErrMember;
+
+	Q_NO_UNIQUE_ADDRESS FuncOutMember m_funcOut;
+	Q_NO_UNIQUE_ADDRESS FuncErrMember m_funcErr;
+
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdOut, QHandle, QNone<2>> m_hStdoutRead;
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdErr, QHandle, QNone<3>> m_hStdErrRead;
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdIn, QHandle, QNone<4>> m_hStdinWrite;
+
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdOut && !kIsPort, QReader, QNone<5>> m_readerOut;
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdErr && !kIsPort, QReader, QNone<6>> m_readerErr;
+
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdOut && kIsPort, QIoStream*, QNone<7>> m_pStreamOut{};
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdErr && kIsPort, QIoStream*, QNone<8>> m_pStreamErr{};
+	Q_NO_UNIQUE_ADDRESS std::conditional_t<kIsStdIn && kIsPort, QIoStream*, QNone<9>> m_pStreamIn{};
+
+	HANDLE m_hChildProcess;
+	DWORD m_dwChildProcessID;
+	bool m_bIsClosed;
+private:
+	/// <summary>
+	/// Callback of a stream that is redirected, placeholder otherwise
+	/// </summary>
+	template<typename Member, typename Func>
+	static Member Keep(Func&& func)
+	{
+		if constexpr (std::is_constructible_v<Member, Func&&>)
+			return std::forward<Func>(func);
+		else
+			return Member();
+	}
+
+	/// <summary>
+	/// Pipe with the parent end not inheritable
+	/// </summary>
+	static bool CreateChildPipe(bool isParentRead, HANDLE& hParent, HANDLE& hChild)
+	{
+		if constexpr (kIsPort)
+		{
+			return QCompletionEngine::CreateOverlappedPipe(isParentRead, hParent, hChild);
+		}
+		else
+		{
+			SECURITY_ATTRIBUTES sa;
+			sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+			sa.lpSecurityDescriptor = nullptr;
+			sa.bInheritHandle = TRUE;
+
+			HANDLE hRead = INVALID_HANDLE_VALUE;
+			HANDLE hWrite = INVALID_HANDLE_VALUE;
+			if (!CreatePipe(&hRead, &hWrite, &sa, 0))
+				return false;
+
+			hParent = isParentRead ? hRead : hWrite;
+			hChild = isParentRead ? hWrite : hRead;
+			return SetHandleInformation(hParent, HANDLE_FLAG_INHERIT, 0) != FALSE;
+		}
+	}
+
+	template<void (QLeanProcess::*Dispatch)(const char*, size_t)>
+	void ReadLoop(HANDLE hRead)
+	{
+		char buffer[4096];
+		DWORD dwRead = 0;
+
+		//Ends with ERROR_BROKEN_PIPE when the child closes its end
+		while (ReadFile(hRead, buffer, sizeof(buffer), &dwRead, nullptr) && dwRead != 0)
+			(this->*Dispatch)(buffer, static_cast<size_t>(dwRead));
+	}
+
+	template<void (QLeanProcess::*Dispatch)(const char*, size_t)>
+	void StartReader(QReader& reader, HANDLE hRead)
+	{
+		reader.thread = std::thread([this, &reader, hRead]() {
+			ReadLoop<Dispatch>(hRead);
+			reader.isExited = true;
+		});
+	}
+
+	static void StopReader(QReader& reader, bool isDrain)
+	{
+		if (!reader.thread.joinable()) return;
+
+		for (int i = 0; !reader.isExited; ++i)
+		{
+			//Grandchildren may keep the pipe open, do not wait for them for long
+			if (!isDrain || i >= 100)
+				CancelSynchronousIo(reinterpret_cast<HANDLE>(reader.thread.native_handle()));
+			Sleep(1);
+		}
+		reader.thread.join();
+	}
+
+	bool Open(StringType strFileName, StringType strCurrentDirectory, StringType strEnvironment, bool isCreateNoWindow)
+	{
+		if constexpr (kIsPort)
+		{
+			if (QCompletionEngine::Shared() == nullptr)
+			{
+				PrintError("Completion port not available");
+				return false;
+			}
+		}
+
+		HANDLE hParent[3] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };	//Out, Err, In
+		HANDLE hChild[3] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+
+		bool bOK = (!kIsStdOut || CreateChildPipe(true, hParent[0], hChild[0])) &&
+			(!kIsStdErr || CreateChildPipe(true, hParent[1], hChild[1])) &&
+			(!kIsStdIn || CreateChildPipe(false, hParent[2], hChild[2]));
+
+		if (!bOK)
+			PrintError("CreatePipe");
+		else
+			bOK = CreateChildProcess(strFileName, strCurrentDirectory, strEnvironment, isCreateNoWindow, hChild[0], hChild[2], hChild[1]);
+
+		//Only the child may keep these, or the read side never sees the pipe break
+		for (HANDLE h : hChild)
+		{
+			if (h != INVALID_HANDLE_VALUE)
+				CloseHandle(h);
+		}
+
+		if (!bOK)
+		{
+			for (HANDLE h : hParent)
+			{
+				if (h != INVALID_HANDLE_VALUE)
+					CloseHandle(h);
+			}
+			m_bIsClosed = true;
+			return false;
+		}
+
+		if constexpr (kIsStdOut)
+		{
+			m_hStdoutRead.Set(hParent[0]);
+			if constexpr (kIsPort)
+				m_pStreamOut = QCompletionEngine::Shared()->RegisterRead(hParent[0],
+					[this](const char* byteData, size_t sizeData) { DispatchStdOut(byteData, sizeData); },
+					nullptr);
+			else
+				StartReader<&QLeanProcess::DispatchStdOut>(m_readerOut, hParent[0]);
+		}
+
+		if constexpr (kIsStdErr)
+		{
+			m_hStdErrRead.Set(hParent[1]);
+			if constexpr (kIsPort)
+				m_pStreamErr = QCompletionEngine::Shared()->RegisterRead(hParent[1],
+					[this](const char* byteData, size_t sizeData) { DispatchStdErr(byteData, sizeData); },
+					nullptr);
+			else
+				StartReader<&QLeanProcess::DispatchStdErr>(m_readerErr, hParent[1]);
+		}
+
+		if constexpr (kIsStdIn)
+		{
+			m_hStdinWrite.Set(hParent[2]);
+			if constexpr (kIsPort)
+				m_pStreamIn = QCompletionEngine::Shared()->RegisterWrite(hParent[2]);
+		}
+
+		return true;
+	}
+
+	bool CreateChildProcess(StringType& strFileName, const StringType& strCurrentDirectory,
+		StringType& strEnvironment, bool isCreateNoWindow,
+		HANDLE hStdOut, HANDLE hStdIn, HANDLE hStdErr)
+	{
+		QCHILDOPTIONS options;
+		options.hStdOut = hStdOut;
+		options.hStdIn = hStdIn;
+		options.hStdErr = hStdErr;
+		options.isCreateNoWindow = isCreateNoWindow;
+
+		PROCESS_INFORMATION pi;
+		if (!QChildProcess::Create(strFileName, strCurrentDirectory, strEnvironment, options, pi))
+		{
+			PrintError("CreateProcess");
+			return false;
+		}
+
+		m_hChildProcess = pi.hProcess;
+		m_dwChildProcessID = pi.dwProcessId;
+		CloseHandle(pi.hThread);
+		return true;
+	}
+};
@@ -4,27 +4,18 @@
 //---------------------------------------------
 
 
-#include <iostream>
-#include <format>
 #include "QProcess.h"
 #include <memory>
-#include <tlhelp32.h>
+#include <new>
+#include <system_error>
+#include <algorithm>
 
-extern std::string utf8_encode(const std::wstring& wstr);
-extern std::wstring utf8_decode(const std::string& str);
-
-void TraceW(const std::string& data)
-{
-	std::wstring dataW = std::move(utf8_decode(data));
-	OutputDebugStringW(dataW.c_str());
-}
-
-void TraceA(const std::string& data)
+QProcess::QProcess(QPROCESSCONFIG config)
+	: QProcess(std::move(config), false)
 {
-	OutputDebugStringA(data.c_str());
 }
 
-QProcess::QProcess(QPROCESSCONFIG config)
+QProcess::QProcess(QPROCESSCONFIG config, bool isDeferStart)
 	: m_strFileName(std::move(config.strFileName))
 	, m_strCurrentDirectory(std::move(config.strCurrentDirectory))
 	, m_funcDataOut(std::move(config.stdOutFunc))
@@ -34,14 +25,59 @@ QProcess::QProcess(QPROCESSCONFIG config)
 	, m_bIsRedirectStdInput(config.isRedirectStdInput)
 	, m_bIsCreateNoWindow(config.isCreateNoWindow)
 	, m_strEnvironment(std::move(config.strEnvironment))
+	, m_bIsPseudoConsole(config.isUsePseudoConsole)
+	, m_nPtyColumns(config.nPtyColumns)
+	, m_nPtyRows(config.nPtyRows)
+	, m_bIsEnableExpect(config.isEnableExpect)
+	, m_bIsOutputEnd(false)
+	, m_ioEngine(config.ioEngine)
+	, m_pEngine(nullptr)
+	, m_pStreamOut(nullptr)
+	, m_pStreamErr(nullptr)
+	, m_pStreamIn(nullptr)
+	, m_nOpenStreams(0)
+	, m_dwDeadlineMs(config.dwDeadlineMs)
+	, m_dwIdleTimeoutMs(config.dwIdleTimeoutMs)
+	, m_funcTimeout(std::move(config.timeoutFunc))
+	, m_nLastOutputMs(0)
+	, m_bIsKilled(false)
+	, m_nStdinBacklog(0)
+	, m_bIsStdinBroken(false)
+	, m_bStdinStop(false)
+	, m_bStdinExited(false)
 	, m_bufferSize(4096)
 	, m_hChildProcess(INVALID_HANDLE_VALUE)
 	, m_eventThreadStop(false)
 	, m_dwChildProcessID(0)
 	, m_bIsClosed(false)
+	, m_dwSpawnError(0)
 {
-	Open();
-	AsyncRead();
+	if (config.nRetentionBytes != 0)
+	{
+		m_pRetainOut = std::make_unique<QRetentionRing>(config.nRetentionBytes);
+		m_pRetainErr = std::make_unique<QRetentionRing>(config.nRetentionBytes);
+	}
+
+	//Engine threads are shared by every child on the port, a full queue must not park one.
+	//Spill keeps the data and the order without waiting
+	if (config.ioEngine == QIoEngine::CompletionPort &&
+		!config.isUsePseudoConsole &&
+		config.dispatchConfig.overflowPolicy == QOverflowPolicy::Block)
+		config.dispatchConfig.overflowPolicy = QOverflowPolicy::SpillToDisk;
+
+	if (config.dispatchConfig.ordering == QDispatchOrdering::PerProcess)
+	{
+		m_pDispatchOut = std::make_unique<QStreamDispatcher>(m_funcDataOut, m_funcErrorOut, config.dispatchConfig);
+	}
+	else
+	{
+		m_pDispatchOut = std::make_unique<QStreamDispatcher>(m_funcDataOut, nullptr, config.dispatchConfig);
+		m_pDispatchErr = std::make_unique<QStreamDispatcher>(nullptr, m_funcErrorOut, config.dispatchConfig);
+	}
+
+	//Failed Open() has closed everything, nothing to read
+	if (Open() && !isDeferStart)
+		Start();
 }
 
 
@@ -52,43 +88,17 @@ QProcess::~QProcess()
 
 bool QProcess::CreateChildProcess(HANDLE hStdOut, HANDLE hStdIn, HANDLE hStdErr)
 {
-	PROCESS_INFORMATION pi;
-	STARTUPINFO si;
-
-	ZeroMemory(&pi, sizeof(PROCESS_INFORMATION));
-	ZeroMemory(&si, sizeof(STARTUPINFO));
-	si.cb = sizeof(STARTUPINFO);
-	si.hStdOutput = hStdOut;
-	si.hStdInput = hStdIn;
-	si.hStdError = hStdErr;
-
-	if (m_bIsRedirectStdInput ||
-		m_bIsRedirectStdOutput ||
-		m_bIsRedirectStdError)
-	{
-		si.dwFlags |= STARTF_USESTDHANDLES;
-	}
+	QCHILDOPTIONS options;
+	options.hStdOut = hStdOut;
+	options.hStdIn = hStdIn;
+	options.hStdErr = hStdErr;
+	options.hPseudoConsole = m_bIsPseudoConsole ? m_pseudoConsole.Get() : nullptr;
+	options.isCreateNoWindow = m_bIsCreateNoWindow;
 
-	DWORD creationFlags = 0;
-	if (m_bIsCreateNoWindow)
-		creationFlags |= CREATE_NO_WINDOW;
-
-#ifdef UNICODE
-	creationFlags |= CREATE_UNICODE_ENVIRONMENT;
-#endif
-
-
-	if (!CreateProcess(nullptr,
-		m_strFileName.data(),
-		nullptr,
-		nullptr,
-		TRUE,
-		creationFlags,
-		m_strEnvironment.empty() ? nullptr : m_strEnvironment.data(),
-		nullptr,
-		&si,
-		&pi))
+	PROCESS_INFORMATION pi;
+	if (!QChildProcess::Create(m_strFileName, m_strCurrentDirectory, m_strEnvironment, options, pi))
 	{
+		m_dwSpawnError = GetLastError();
 		PrintError("CreateProcess");
 		return false;
 	}
@@ -101,8 +111,25 @@ bool QProcess::CreateChildProcess(HANDLE hStdOut, HANDLE hStdIn, HANDLE hStdErr)
 	return true;
 }
 
-bool QProcess::Write(const char* byte, const size_t& length) const
+bool QProcess::Write(const char* byte, const size_t& length)
 {
+	if (m_pStreamIn != nullptr)
+		return m_pEngine->Write(m_pStreamIn, std::make_shared<const std::string>(byte, length));
+
+	//Behind queued broadcasts
+	{
+		std::lock_guard<std::mutex> lock(m_lockStdin);
+		if (m_threadStdIn.joinable())
+		{
+			if (m_bIsStdinBroken) return false;
+
+			m_stdinQueue.push_back(std::make_shared<const std::string>(byte, length));
+			m_nStdinBacklog += length;
+			m_cvStdin.notify_one();
+			return true;
+		}
+	}
+
 	DWORD dwWritten = 0;
 	BOOL bSucess = FALSE;
 
@@ -118,8 +145,205 @@ bool QProcess::Write(const char* byte, const size_t& length) const
 	return true;
 }
 
+bool QProcess::QueueWrite(std::shared_ptr<const std::string> data)
+{
+	if (!m_bIsRedirectStdInput || m_bIsClosed) return false;
+	if (data == nullptr || data->empty()) return true;
+
+	if (m_pStreamIn != nullptr)
+		return m_pEngine->Write(m_pStreamIn, std::move(data));
+
+	std::lock_guard<std::mutex> lock(m_lockStdin);
+	if (m_bIsStdinBroken) return false;
+
+	if (!m_threadStdIn.joinable())
+		m_threadStdIn = std::thread([this]() { StdinLoop(); });
+
+	m_nStdinBacklog += data->size();
+	m_stdinQueue.push_back(std::move(data));
+	m_cvStdin.notify_one();
+	return true;
+}
+
+void QProcess::StdinLoop()
+{
+	for (;;)
+	{
+		std::shared_ptr<const std::string> data;
+		{
+			std::unique_lock<std::mutex> lock(m_lockStdin);
+			m_cvStdin.wait(lock, [this]() { return m_bStdinStop || !m_stdinQueue.empty(); });
+			if (m_bStdinStop) break;
+
+			data = m_stdinQueue.front();
+		}
+
+		//Straight from the shared buffer, in pieces so the backlog moves
+		bool bOK = true;
+		std::size_t nOffset = 0;
+		while (bOK && nOffset < data->size() && !m_bStdinStop)
+		{
+			DWORD dwLength = static_cast<DWORD>((std::min)(data->size() - nOffset, static_cast<std::size_t>(1024 * 1024)));
+			DWORD dwWritten = 0;
+			bOK = WriteFile(m_hStdinWrite(), data->data() + nOffset, dwLength, &dwWritten, nullptr) && dwWritten != 0;
+			nOffset += dwWritten;
+
+			std::lock_guard<std::mutex> lock(m_lockStdin);
+			m_nStdinBacklog -= dwWritten;
+		}
+
+		std::lock_guard<std::mutex> lock(m_lockStdin);
+		if (nOffset == data->size())
+		{
+			m_stdinQueue.pop_front();
+			continue;
+		}
+
+		//Child closed stdin or Close() cancelled the write
+		if (!m_bStdinStop)
+			PrintError("WriteFile");
+		m_bIsStdinBroken = true;
+		m_stdinQueue.clear();
+		m_nStdinBacklog = 0;
+	}
+
+	m_bStdinExited = true;
+}
+
+std::size_t QProcess::BroadcastWrite(std::span<QProcess* const> processes, std::shared_ptr<const std::string> data)
+{
+	std::size_t nQueued = 0;
+	for (QProcess* pProcess : processes)
+	{
+		if (pProcess != nullptr && pProcess->QueueWrite(data))
+			nQueued++;
+	}
+	return nQueued;
+}
+
+void QProcess::Start()
+{
+	if (m_pEngine != nullptr)
+		RegisterStreams();
+	else
+		AsyncRead();
+
+	StartWatchdog();
+}
+
+/// <summary>
+/// Win32 error for the exception being handled by SpawnMany
+/// </summary>
+static DWORD SpawnExceptionError()
+{
+	try
+	{
+		throw;
+	}
+	catch (const std::bad_alloc&)
+	{
+		PrintError("SpawnMany out of memory");
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	catch (const std::system_error& e)
+	{
+		PrintError(e.what());
+		return e.code().category() == std::system_category() ? e.code().value() : ERROR_INTERNAL_ERROR;
+	}
+	catch (const std::exception& e)
+	{
+		PrintError(e.what());
+		return ERROR_INTERNAL_ERROR;
+	}
+	catch (...)
+	{
+		PrintError("SpawnMany unknown exception");
+		return ERROR_INTERNAL_ERROR;
+	}
+}
+
+std::vector<QSPAWNRESULT> QProcess::SpawnMany(std::span<const QPROCESSCONFIG> configs, std::size_t nThreads)
+{
+	std::vector<QSPAWNRESULT> results(configs.size());
+	if (configs.empty()) return results;
+
+	if (nThreads == 0)
+		nThreads = std::max<std::size_t>(2, std::thread::hardware_concurrency());
+	nThreads = (std::min)(nThreads, configs.size());
+
+	//Pipes and CreateProcess on a few threads, readers not started yet
+	std::atomic<std::size_t> nNext(0);
+	auto spawn = [&]() {
+		for (std::size_t i = nNext++; i < configs.size(); i = nNext++)
+		{
+			QSPAWNRESULT& result = results[i];
+
+			//One item failing to allocate must not take down the batch or the thread
+			try
+			{
+				std::unique_ptr<QProcess> pProcess(new QProcess(configs[i], true));
+
+				result.isSuccess = pProcess->m_hChildProcess != INVALID_HANDLE_VALUE;
+				result.dwProcessId = pProcess->m_dwChildProcessID;
+				result.dwError = result.isSuccess ? 0 : pProcess->m_dwSpawnError;
+				if (result.isSuccess)
+					result.pProcess = std::move(pProcess);
+			}
+			catch (...)
+			{
+				result.isSuccess = false;
+				result.dwError = SpawnExceptionError();
+			}
+		}
+	};
+
+	//Fewer spawn threads if the system will not give more, the rest of the batch runs here
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < nThreads; ++i)
+	{
+		try
+		{
+			threads.emplace_back(spawn);
+		}
+		catch (const std::exception& e)
+		{
+			PrintError(e.what());
+			break;
+		}
+	}
+	spawn();
+
+	for (auto& thread : threads)
+		thread.join();
+
+	//Readers, engine registration and watchdogs in one pass
+	for (auto& result : results)
+	{
+		if (!result.pProcess) continue;
+
+		try
+		{
+			result.pProcess->Start();
+		}
+		catch (...)
+		{
+			result.isSuccess = false;
+			result.dwError = SpawnExceptionError();
+
+			//Not handed out, nobody else would stop it. Close() alone leaves it running
+			result.pProcess->Kill();
+			result.pProcess.reset();
+		}
+	}
+
+	return results;
+}
+
 void QProcess::AsyncRead()
 {
+	//Engine threads read
+	if (m_pEngine != nullptr) return;
+
 	if (!m_bIsRedirectStdOutput &&
 		!m_bIsRedirectStdError) return;
 
@@ -128,7 +352,10 @@ void QProcess::AsyncRead()
 
 	//Check function empty or not
 	if (m_funcDataOut == nullptr &&
-	    m_funcErrorOut == nullptr) return;
+	    m_funcErrorOut == nullptr &&
+		!m_bIsEnableExpect &&
+		m_dwIdleTimeoutMs == 0 &&
+		m_pRetainOut == nullptr) return;
 
 	m_threadStdOut = std::thread([this]() {
 
@@ -155,10 +382,27 @@ void QProcess::AsyncRead()
 					break;
 				}
 
+				//Pseudo console keeps the output pipe open after the child exits.
+				//Conhost may still flush, read until it stays quiet
+				if (m_bIsPseudoConsole && WaitForExit(0))
+				{
+					for (DWORD dwAvail = 1; nRet > 0 && dwAvail != 0;)
+					{
+						nRet = Read();
+						Sleep(20);
+						if (!::PeekNamedPipe(m_hStdoutRead(), NULL, 0, NULL, &dwAvail, NULL))
+							dwAvail = 0;
+					}
+					if (nRet > 0) nRet = 0;
+					break;
+				}
+
 				//Avoid overheat
 				Sleep(5);
 
 			}
+
+			OnOutputEnd();
 		});
 
 }
@@ -170,6 +414,9 @@ int QProcess::Read()
 
 	for (;;)
 	{
+		//Each stream on every pass. An empty stdout must not hold back stderr
+		bool bIsRead = false;
+
 		//Read dataout
 		if (m_bIsRedirectStdOutput)
 		{
@@ -184,26 +431,26 @@ int QProcess::Read()
 				break;
 			}
 
-			if (!dwAvail)
-				return 1; // Not data available
-
-			dwDataSize = min(m_bufferSize, dwAvail);
-			std::unique_ptr<char[]> buffer(new char[dwDataSize]);
-
-			DWORD dwRead = 0;
-			if (!ReadFile(m_hStdoutRead(),
-				static_cast<char*>(buffer.get()),
-				static_cast<DWORD>(dwDataSize),
-				&dwRead,
-				nullptr))
+			if (dwAvail)
 			{
-				PrintError("ReadFile");
-				break;
-			}
+				dwDataSize = min(m_bufferSize, dwAvail);
+				std::unique_ptr<char[]> buffer(new char[dwDataSize]);
+
+				DWORD dwRead = 0;
+				if (!ReadFile(m_hStdoutRead(),
+					static_cast<char*>(buffer.get()),
+					static_cast<DWORD>(dwDataSize),
+					&dwRead,
+					nullptr))
+				{
+					PrintError("ReadFile");
+					break;
+				}
 
-			//Call back
-			if(m_funcDataOut != nullptr)
-				m_funcDataOut(buffer.get(), static_cast<size_t>(dwDataSize));
+				//Call back
+				OnDataOut(buffer.get(), static_cast<size_t>(dwRead));
+				bIsRead = true;
+			}
 		}
 
 		//Read errorout
@@ -220,27 +467,30 @@ int QProcess::Read()
 				break;
 			}
 
-			if (!dwAvail)
-				return 1; // Not data available
-
-			dwDataSize = min(m_bufferSize, dwAvail);
-			std::unique_ptr<char[]> buffer(new char[dwDataSize]);
-
-			DWORD dwRead = 0;
-			if (!ReadFile(m_hStdErrRead(),
-				static_cast<char*>(buffer.get()),
-				static_cast<DWORD>(dwDataSize),
-				&dwRead,
-				nullptr))
+			if (dwAvail)
 			{
-				PrintError("ReadFile");
-				break;
-			}
+				dwDataSize = min(m_bufferSize, dwAvail);
+				std::unique_ptr<char[]> buffer(new char[dwDataSize]);
+
+				DWORD dwRead = 0;
+				if (!ReadFile(m_hStdErrRead(),
+					static_cast<char*>(buffer.get()),
+					static_cast<DWORD>(dwDataSize),
+					&dwRead,
+					nullptr))
+				{
+					PrintError("ReadFile");
+					break;
+				}
 
-			//Call back
-			if(m_funcErrorOut != nullptr)
-				m_funcErrorOut(buffer.get(), static_cast<size_t>(dwDataSize));
+				//Call back
+				OnDataErr(buffer.get(), static_cast<size_t>(dwRead));
+				bIsRead = true;
+			}
 		}
+
+		if (!bIsRead)
+			return 1; // Not data available
 	}
 
 	DWORD dwError = ::GetLastError();
@@ -255,8 +505,127 @@ int QProcess::Read()
 	return -1;
 }
 
+void QProcess::OnDataOut(const char* byteData, size_t sizeData)
+{
+	if (m_dwIdleTimeoutMs != 0)
+		m_nLastOutputMs.store(GetTickCount64(), std::memory_order_relaxed);
+
+	if (m_bIsEnableExpect)
+	{
+		bool bMatched = false;
+		{
+			std::lock_guard<std::mutex> lock(m_lockExpect);
+			m_expect.Feed(byteData, sizeData);
+			bMatched = m_expect.HasMatch();
+		}
+
+		//Wake only when a match is complete
+		if (bMatched)
+			m_cvExpect.notify_all();
+	}
+
+	if (m_pRetainOut)
+		m_pRetainOut->Append(byteData, sizeData);
+
+	m_pDispatchOut->Dispatch(QStreamDispatcher::ChannelOut, byteData, sizeData);
+}
+
+void QProcess::OnDataErr(const char* byteData, size_t sizeData)
+{
+	if (m_dwIdleTimeoutMs != 0)
+		m_nLastOutputMs.store(GetTickCount64(), std::memory_order_relaxed);
+
+	if (m_pRetainErr)
+		m_pRetainErr->Append(byteData, sizeData);
+
+	QStreamDispatcher* pDispatcher = m_pDispatchErr ? m_pDispatchErr.get() : m_pDispatchOut.get();
+	pDispatcher->Dispatch(QStreamDispatcher::ChannelErr, byteData, sizeData);
+}
+
+void QProcess::OnStreamEnd()
+{
+	if (--m_nOpenStreams == 0)
+		OnOutputEnd();
+}
+
+void QProcess::StartWatchdog()
+{
+	if (m_hChildProcess == INVALID_HANDLE_VALUE) return;
+	if (m_bIsKilled) return;
+
+	if (m_dwDeadlineMs != 0)
+	{
+		m_timerDeadline.callback = [this]() { OnTimeout(QTimeoutKind::Deadline); };
+		QTimerWheel::Shared().Arm(&m_timerDeadline, m_dwDeadlineMs);
+	}
+
+	if (m_dwIdleTimeoutMs != 0)
+	{
+		m_nLastOutputMs = GetTickCount64();
+		m_timerIdle.callback = [this]() { OnIdleTimer(); };
+		QTimerWheel::Shared().Arm(&m_timerIdle, m_dwIdleTimeoutMs);
+	}
+}
+
+void QProcess::OnIdleTimer()
+{
+	if (m_bIsKilled || WaitForExit(0)) return;
+
+	//Last output before the clock. A reader storing a newer tick in between
+	//would otherwise wrap the unsigned difference and kill an active child
+	ULONGLONG nLastOutputMs = m_nLastOutputMs.load(std::memory_order_relaxed);
+	ULONGLONG nNowMs = GetTickCount64();
+	ULONGLONG nSilentMs = nNowMs > nLastOutputMs ? nNowMs - nLastOutputMs : 0;
+	if (nSilentMs < m_dwIdleTimeoutMs)
+	{
+		QTimerWheel::Shared().Arm(&m_timerIdle, static_cast<DWORD>(m_dwIdleTimeoutMs - nSilentMs));
+		return;
+	}
+
+	OnTimeout(QTimeoutKind::IdleOutput);
+}
+
+void QProcess::OnTimeout(QTimeoutKind kind)
+{
+	if (m_bIsKilled || WaitForExit(0)) return;
+
+	//Disarms the other timer, on the wheel thread it does not wait
+	Kill();
+
+	if (m_funcTimeout)
+		m_funcTimeout(kind);
+}
+
+void QProcess::OnOutputEnd()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lockExpect);
+		m_bIsOutputEnd = true;
+	}
+	m_cvExpect.notify_all();
+}
+
 bool QProcess::Open()
 {
+	if (m_bIsPseudoConsole)
+	{
+		if (QPseudoConsole::IsSupported())
+			return OpenPseudoConsole();
+
+		PrintError("Pseudo console not supported. Fall back to pipes");
+		m_bIsPseudoConsole = false;
+	}
+
+	if (m_ioEngine == QIoEngine::CompletionPort)
+	{
+		m_pEngine = QCompletionEngine::Shared();
+		if (m_pEngine != nullptr)
+			return OpenCompletionPort();
+
+		PrintError("Completion port not available. Fall back to polling");
+		m_ioEngine = QIoEngine::Polling;
+	}
+
 	//Create 3 anonymous pipe.
 	//Pipe In, Out and Err
 	HANDLE hParentStdInWrite = INVALID_HANDLE_VALUE;	//Parent stdin write handle
@@ -287,6 +656,7 @@ bool QProcess::Open()
 		{
 			if (!CreatePipe(&hParentStdOutRead, &hChildStdOutWrite, &sa, 0))
 			{
+				m_dwSpawnError = GetLastError();
 				PrintError("CreatePipe");
 				__leave;
 			}
@@ -303,6 +673,7 @@ bool QProcess::Open()
 				FALSE,
 				DUPLICATE_SAME_ACCESS))
 			{
+				m_dwSpawnError = GetLastError();
 				PrintError("DuplicateHandle");
 				__leave;
 			}
@@ -318,6 +689,7 @@ bool QProcess::Open()
 		{
 			if (!CreatePipe(&hChildStdInRead, &hParentStdInWrite, &sa, 0))
 			{
+				m_dwSpawnError = GetLastError();
 				PrintError("CreatePipe");
 				__leave;
 			}
@@ -334,6 +706,7 @@ bool QProcess::Open()
 				FALSE,
 				DUPLICATE_SAME_ACCESS))
 			{
+				m_dwSpawnError = GetLastError();
 				PrintError("DuplicateHandle");
 				__leave;
 			}
@@ -348,6 +721,7 @@ bool QProcess::Open()
 		{
 			if (!CreatePipe(&hParentStdErrRead, &hChildStdErrWrite, &sa, 0))
 			{
+				m_dwSpawnError = GetLastError();
 				PrintError("CreatePipe");
 				__leave;
 			}
@@ -364,6 +738,7 @@ bool QProcess::Open()
 				FALSE,
 				DUPLICATE_SAME_ACCESS))
 			{
+				m_dwSpawnError = GetLastError();
 				PrintError("DuplicateHandle");
 				__leave;
 			}
@@ -410,11 +785,160 @@ bool QProcess::Open()
 	return true;
 }
 
+bool QProcess::OpenPseudoConsole()
+{
+	HANDLE hParentInWrite = INVALID_HANDLE_VALUE;	//Parent writes child input
+	HANDLE hParentOutRead = INVALID_HANDLE_VALUE;	//Parent reads child output
+	HANDLE hPtyInRead = INVALID_HANDLE_VALUE;		//Pseudo console reads input
+	HANDLE hPtyOutWrite = INVALID_HANDLE_VALUE;		//Pseudo console writes output
+
+	//Not inheritable. Conhost duplicates the pseudo console ends itself
+	if (!CreatePipe(&hPtyInRead, &hParentInWrite, nullptr, 0) ||
+		!CreatePipe(&hParentOutRead, &hPtyOutWrite, nullptr, 0))
+	{
+		m_dwSpawnError = GetLastError();
+		PrintError("CreatePipe");
+		DestroyHandle(std::move(hPtyInRead));
+		DestroyHandle(std::move(hParentInWrite));
+		DestroyHandle(std::move(hParentOutRead));
+		DestroyHandle(std::move(hPtyOutWrite));
+		return false;
+	}
+
+	bool bCreated = m_pseudoConsole.Create(m_nPtyColumns, m_nPtyRows, hPtyInRead, hPtyOutWrite);
+
+	//Owned by the pseudo console now
+	DestroyHandle(std::move(hPtyInRead));
+	DestroyHandle(std::move(hPtyOutWrite));
+
+	if (!bCreated)
+	{
+		m_dwSpawnError = ERROR_NOT_SUPPORTED;
+		PrintError("CreatePseudoConsole");
+		DestroyHandle(std::move(hParentInWrite));
+		DestroyHandle(std::move(hParentOutRead));
+		return false;
+	}
+
+	m_hStdinWrite.Set(hParentInWrite);
+	m_hStdoutRead.Set(hParentOutRead);
+
+	//Terminal merges stderr into output
+	m_bIsRedirectStdInput = true;
+	m_bIsRedirectStdOutput = true;
+	m_bIsRedirectStdError = false;
+
+	if (!CreateChildProcess(INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE))
+	{
+		PrintError("CreateChild");
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool QProcess::OpenCompletionPort()
+{
+	HANDLE hParentStdInWrite = INVALID_HANDLE_VALUE;
+	HANDLE hParentStdOutRead = INVALID_HANDLE_VALUE;
+	HANDLE hParentStdErrRead = INVALID_HANDLE_VALUE;
+
+	HANDLE hChildStdInRead = INVALID_HANDLE_VALUE;
+	HANDLE hChildStdOutWrite = INVALID_HANDLE_VALUE;
+	HANDLE hChildStdErrWrite = INVALID_HANDLE_VALUE;
+
+	bool bOK = (!m_bIsRedirectStdOutput || QCompletionEngine::CreateOverlappedPipe(true, hParentStdOutRead, hChildStdOutWrite)) &&
+		(!m_bIsRedirectStdError || QCompletionEngine::CreateOverlappedPipe(true, hParentStdErrRead, hChildStdErrWrite)) &&
+		(!m_bIsRedirectStdInput || QCompletionEngine::CreateOverlappedPipe(false, hParentStdInWrite, hChildStdInRead));
+
+	if (!bOK)
+	{
+		m_dwSpawnError = GetLastError();
+		PrintError("CreateOverlappedPipe");
+	}
+	else if (!CreateChildProcess(hChildStdOutWrite, hChildStdInRead, hChildStdErrWrite))
+	{
+		PrintError("CreateChild");
+		bOK = false;
+	}
+
+	//Only the child may keep these, or the read side never sees the pipe break
+	DestroyHandle(std::move(hChildStdOutWrite));
+	DestroyHandle(std::move(hChildStdInRead));
+	DestroyHandle(std::move(hChildStdErrWrite));
+
+	if (!bOK)
+	{
+		DestroyHandle(std::move(hParentStdOutRead));
+		DestroyHandle(std::move(hParentStdErrRead));
+		DestroyHandle(std::move(hParentStdInWrite));
+		Close();
+		return false;
+	}
+
+	m_hStdoutRead.Set(hParentStdOutRead);
+	m_hStdErrRead.Set(hParentStdErrRead);
+	m_hStdinWrite.Set(hParentStdInWrite);
+
+	return true;
+}
+
+void QProcess::RegisterStreams()
+{
+	//Counted up front, a stream can end before the next one is registered
+	m_nOpenStreams = (m_bIsRedirectStdOutput ? 1 : 0) + (m_bIsRedirectStdError ? 1 : 0);
+	if (m_nOpenStreams == 0)
+		OnOutputEnd();
+
+	if (m_bIsRedirectStdOutput)
+	{
+		m_pStreamOut = m_pEngine->RegisterRead(m_hStdoutRead(),
+			[this](const char* byteData, size_t sizeData) {
+				std::lock_guard<std::mutex> lock(m_lockRead);
+				OnDataOut(byteData, sizeData);
+			},
+			[this]() { OnStreamEnd(); });
+		if (m_pStreamOut == nullptr)
+		{
+			PrintError("RegisterRead stdout");
+			OnStreamEnd();
+		}
+	}
+
+	if (m_bIsRedirectStdError)
+	{
+		m_pStreamErr = m_pEngine->RegisterRead(m_hStdErrRead(),
+			[this](const char* byteData, size_t sizeData) {
+				std::lock_guard<std::mutex> lock(m_lockRead);
+				OnDataErr(byteData, sizeData);
+			},
+			[this]() { OnStreamEnd(); });
+		if (m_pStreamErr == nullptr)
+		{
+			PrintError("RegisterRead stderr");
+			OnStreamEnd();
+		}
+	}
+
+	if (m_bIsRedirectStdInput)
+	{
+		m_pStreamIn = m_pEngine->RegisterWrite(m_hStdinWrite());
+		if (m_pStreamIn == nullptr)
+			PrintError("RegisterWrite stdin");
+	}
+}
+
 void QProcess::Close()
 {
 	if (m_bIsClosed) return;
 
 	m_bIsClosed = true;
+
+	//Waits for a timeout in progress, unless Close is called from its callback
+	QTimerWheel::Shared().Cancel(&m_timerDeadline);
+	QTimerWheel::Shared().Cancel(&m_timerIdle);
+
 	//Set at atomic for stopping thread
 	m_eventThreadStop = true;
 
@@ -423,58 +947,106 @@ void QProcess::Close()
 	if (m_threadStdOut.joinable())
 		m_threadStdOut.join();
 
+	//Writer may be blocked on a child that does not read
+	if (m_threadStdIn.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lockStdin);
+			m_bStdinStop = true;
+		}
+		m_cvStdin.notify_all();
+
+		while (!m_bStdinExited)
+		{
+			CancelSynchronousIo(reinterpret_cast<HANDLE>(m_threadStdIn.native_handle()));
+			Sleep(1);
+		}
+		m_threadStdIn.join();
+	}
+
+	//Waits for running callbacks. Stdin not written yet is dropped
+	if (m_pEngine != nullptr)
+	{
+		m_pEngine->Unregister(m_pStreamOut);
+		m_pEngine->Unregister(m_pStreamErr);
+		m_pEngine->Unregister(m_pStreamIn);
+		m_pStreamOut = nullptr;
+		m_pStreamErr = nullptr;
+		m_pStreamIn = nullptr;
+	}
+
+	OnOutputEnd();
+
+	//Deliver what is still queued before the pipes go away
+	m_pDispatchOut->Stop();
+	if (m_pDispatchErr)
+		m_pDispatchErr->Stop();
+
 	m_hStdErrRead.Close();
 	m_hStdinWrite.Close();
 	m_hStdoutRead.Close();
+	m_hStdErrRead.Detach();
+	m_hStdinWrite.Detach();
+	m_hStdoutRead.Detach();
+
+	//After the output pipe is closed, otherwise it can block on unread output
+	m_pseudoConsole.Close();
 
 }
 
-void QProcess::Kill() const
+void QProcess::Kill()
 {
 	if (m_dwChildProcessID == 0) return;
 	if (m_bIsClosed) return;
 
-	auto snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+	//Nothing left for the watchdog. Waits for a timeout in progress, unless called from it
+	m_bIsKilled = true;
+	QTimerWheel::Shared().Cancel(&m_timerDeadline);
+	QTimerWheel::Shared().Cancel(&m_timerIdle);
 
-	if (snapshot != INVALID_HANDLE_VALUE)
-	{
-		PROCESSENTRY32 process;
-		ZeroMemory(&process, sizeof(process));
-		process.dwSize = sizeof(process);
+	QChildProcess::KillTree(m_dwChildProcessID, m_hChildProcess.load());
+}
 
-		if (Process32First(snapshot, &process))
-		{
-			do
-			{
-				if (process.th32ParentProcessID == m_dwChildProcessID)
-				{
-					HANDLE process_handle = OpenProcess(PROCESS_TERMINATE, FALSE, process.th32ProcessID);
-					if (process_handle) {
-						TerminateProcess(process_handle, 2);
-						CloseHandle(process_handle);
-					}
-				}
-			} while (Process32Next(snapshot, &process));
-		}
-		CloseHandle(snapshot);
-	}
-	else
+void QProcess::WriteCommand(const std::string& strCommand)
+{
+	//Terminal takes carriage return as Enter
+	std::string newCommand = strCommand + (m_bIsPseudoConsole ? "\r" : "\r\n");
+
+	if (!Write(newCommand.c_str(), newCommand.size()))
+		PrintError("");
+}
+
+bool QProcess::WriteData(const char* byte, const size_t& length)
+{
+	if (!Write(byte, length))
 	{
-		TerminateProcess(m_hChildProcess, 2);
+		PrintError("WriteFile");
+		return false;
 	}
+	return true;
+}
 
+DWORD QProcess::GetProcessId() const noexcept
+{
+	return m_dwChildProcessID;
 }
 
-void QProcess::WriteCommand(const std::string& strCommand)
+bool QProcess::WaitForExit(DWORD dwTimeoutMs) const
 {
-	std::string newCommand = strCommand + "\r\n";
+	HANDLE hProcess = m_hChildProcess.load();
+	if (hProcess == INVALID_HANDLE_VALUE) return true;
 
-	if (!Write(newCommand.c_str(), newCommand.size()))
-		PrintError("");
+	return WaitForSingleObject(hProcess, dwTimeoutMs) == WAIT_OBJECT_0;
 }
 
 std::string QProcess::ReadLineDataOut()
 {
+	if (m_pEngine != nullptr)
+	{
+		PrintError("ReadLineDataOut is not supported with the completion engine");
+		return "";
+	}
+
 	//Sleep Xms at here to make sure "data avaiable at pipe"
 	//without sleep can not get data out
 	//This number may vary
@@ -514,23 +1086,103 @@ std::string QProcess::ReadLineDataOut()
 	return std::string(buffer.get(), static_cast<size_t>(dwAvail));
 }
 
-void QProcess::DestroyHandle(HANDLE&& rhObject)
+QEXPECTRESULT QProcess::Expect(const std::vector<QEXPECTPATTERN>& patterns, DWORD dwTimeoutMs)
 {
-	if (rhObject == INVALID_HANDLE_VALUE) return;
+	QEXPECTRESULT result;
+	result.nIndex = -1;
+	result.isTimeout = false;
+	result.isEof = false;
 
-	::CloseHandle(rhObject);
-	rhObject = INVALID_HANDLE_VALUE;
+	if (!m_bIsEnableExpect)
+	{
+		PrintError("Expect is not enabled");
+		return result;
+	}
+
+	std::unique_lock<std::mutex> lock(m_lockExpect);
+
+	if (!m_expect.Compile(patterns))
+		PrintError("Invalid regex pattern");
+
+	auto isReady = [this]() {
+		return m_expect.HasMatch() || m_bIsOutputEnd;
+	};
+
+	if (dwTimeoutMs == INFINITE)
+	{
+		m_cvExpect.wait(lock, isReady);
+	}
+	else if (!m_cvExpect.wait_for(lock, std::chrono::milliseconds(dwTimeoutMs), isReady))
+	{
+		//Keep the text, next Expect may still match it
+		result.isTimeout = true;
+		result.strBefore = m_expect.Pending();
+		return result;
+	}
+
+	if (m_expect.HasMatch())
+		return m_expect.TakeMatch();
 
+	result.isEof = true;
+	result.strBefore = m_expect.TakePending();
+	return result;
 }
 
-void QProcess::PrintError(const char* mess, const std::source_location& location)
+bool QProcess::ResizePseudoConsole(short nColumns, short nRows)
 {
-	std::string dataFormat = std::format("Error. Message: {}. Function: {}. Line: {}",
-		mess,
-		location.function_name(),
-		location.line());
+	if (!m_bIsPseudoConsole) return false;
 
-	std::cout << dataFormat << std::endl;
+	if (!m_pseudoConsole.Resize(nColumns, nRows))
+	{
+		PrintError("ResizePseudoConsole");
+		return false;
+	}
+
+	m_nPtyColumns = nColumns;
+	m_nPtyRows = nRows;
+	return true;
+}
 
-	TRACE_ERROR(dataFormat);
+QQUEUEMETRICS QProcess::GetStdOutQueueMetrics() const
+{
+	return m_pDispatchOut->GetMetrics();
+}
+
+QQUEUEMETRICS QProcess::GetStdErrQueueMetrics() const
+{
+	return m_pDispatchErr ? m_pDispatchErr->GetMetrics() : m_pDispatchOut->GetMetrics();
 }
+
+QRETENTIONSNAPSHOT QProcess::SnapshotStdOut(std::size_t nMaxBytes) const
+{
+	if (m_pRetainOut == nullptr)
+		return QRETENTIONSNAPSHOT();
+
+	return m_pRetainOut->Snapshot(nMaxBytes);
+}
+
+QRETENTIONSNAPSHOT QProcess::SnapshotStdErr(std::size_t nMaxBytes) const
+{
+	if (m_pRetainErr == nullptr)
+		return QRETENTIONSNAPSHOT();
+
+	return m_pRetainErr->Snapshot(nMaxBytes);
+}
+
+std::size_t QProcess::GetStdInBacklog() const
+{
+	if (m_pStreamIn != nullptr)
+		return m_pEngine->GetWriteBacklog(m_pStreamIn);
+
+	std::lock_guard<std::mutex> lock(m_lockStdin);
+	return m_nStdinBacklog;
+}
+
+void QProcess::DestroyHandle(HANDLE&& rhObject)
+{
+	if (rhObject == INVALID_HANDLE_VALUE) return;
+
+	::CloseHandle(rhObject);
+	rhObject = INVALID_HANDLE_VALUE;
+
+}
\ No newline at end of file
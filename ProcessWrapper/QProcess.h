@@ -3,23 +3,34 @@
 #include <functional>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <source_location>
 #include <Windows.h>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <span>
 #include "QHandle.h"
+#include "QDispatcher.h"
+#include "QPseudoConsole.h"
+#include "QExpect.h"
+#include "QCompletionEngine.h"
+#include "QTimerWheel.h"
+#include "QRetentionRing.h"
+#include "QChildProcess.h"
+#include "Utility.h"
 
-void TraceW(const std::string& data);
-void TraceA(const std::string& data);
-
-#ifdef  UNICODE
-typedef std::wstring QString;
-#define TRACE_ERROR TraceW
-#else
-typedef std::string QString;
-#define TRACE_ERROR TraceA
-#endif
-
-typedef std::function<void(const char* byteData, const size_t& sizeData)> processFuncDataOutCallBack;
+/// <summary>
+/// Why the watchdog killed the child
+/// </summary>
+enum class QTimeoutKind
+{
+	Deadline,	//Ran longer than dwDeadlineMs
+	IdleOutput	//No stdout/stderr for dwIdleTimeoutMs
+};
 
+typedef std::function<void(QTimeoutKind kind)> processFuncTimeoutCallBack;
 
 typedef struct _QPROCESSCONFIG {
 	QString strFileName;
@@ -31,6 +42,16 @@ typedef struct _QPROCESSCONFIG {
 	bool isRedirectStdInput;
 	bool isCreateNoWindow;
 	QString strEnvironment;
+	QDISPATCHCONFIG dispatchConfig;	//How and where stdOutFunc/stdErrFunc run
+	bool isUsePseudoConsole;		//Child gets a ConPTY instead of pipes. stdout and stderr are merged
+	short nPtyColumns;
+	short nPtyRows;
+	bool isEnableExpect;			//Buffer stdout for Expect(). Reader thread runs even without callbacks
+	QIoEngine ioEngine;				//CompletionPort: overlapped pipes on the shared engine, no reader thread
+	DWORD dwDeadlineMs;				//Kill child after this long, 0 for none
+	DWORD dwIdleTimeoutMs;			//Kill child when stdout and stderr stay silent this long, 0 for none. Reader thread runs even without callbacks
+	processFuncTimeoutCallBack timeoutFunc;	//Runs on the watchdog thread after the kill
+	std::size_t nRetentionBytes;	//Keep this much recent stdout and stderr for SnapshotStdOut/Err, 0 for none
 
 public:
 #ifdef UNICODE
@@ -52,6 +73,14 @@ public:
 		, isRedirectStdInput(isRedirectStdInput)
 		, isCreateNoWindow(isCreateNoWindow)
 		, strEnvironment(strEnvironment)
+		, isUsePseudoConsole(false)
+		, nPtyColumns(120)
+		, nPtyRows(30)
+		, isEnableExpect(false)
+		, ioEngine(QIoEngine::Polling)
+		, dwDeadlineMs(0)
+		, dwIdleTimeoutMs(0)
+		, nRetentionBytes(0)
 	{
 	}
 #else
@@ -73,6 +102,14 @@ public:
 		, isRedirectStdInput(isRedirectStdInput)
 		, isCreateNoWindow(isCreateNoWindow)
 		, strEnvironment(strEnvironment)
+		, isUsePseudoConsole(false)
+		, nPtyColumns(120)
+		, nPtyRows(30)
+		, isEnableExpect(false)
+		, ioEngine(QIoEngine::Polling)
+		, dwDeadlineMs(0)
+		, dwIdleTimeoutMs(0)
+		, nRetentionBytes(0)
 	{
 	}
 #endif
@@ -81,6 +118,31 @@ public:
 
 }QPROCESSCONFIG, *PQPROCESSCONFIG;
 
+class QProcess;
+
+/// <summary>
+/// Outcome of one item of QProcess::SpawnMany
+/// </summary>
+typedef struct _QSPAWNRESULT {
+	std::unique_ptr<QProcess> pProcess;	//nullptr when the spawn failed
+	DWORD dwProcessId;
+	DWORD dwError;		//Win32 error of the failed step, 0 on success
+	bool isSuccess;
+
+public:
+	_QSPAWNRESULT()
+		: pProcess(nullptr)
+		, dwProcessId(0)
+		, dwError(0)
+		, isSuccess(false)
+	{
+	}
+}QSPAWNRESULT, *PQSPAWNRESULT;
+
+/// <summary>
+/// Everything chosen at runtime from QPROCESSCONFIG.
+/// See QLeanProcess for a process fixed at compile time
+/// </summary>
 class QProcess
 {
 public:
@@ -102,6 +164,13 @@ private:
 	processFuncDataOutCallBack m_funcDataOut;
 	processFuncDataOutCallBack m_funcErrorOut;
 
+	/// <summary>
+	/// Queue between reader and callbacks.
+	/// m_pDispatchErr is empty when both streams share one queue
+	/// </summary>
+	std::unique_ptr<QStreamDispatcher> m_pDispatchOut;
+	std::unique_ptr<QStreamDispatcher> m_pDispatchErr;
+
 	/// <summary>
 	/// Process configuration
 	/// </summary>
@@ -112,6 +181,67 @@ private:
 	QString m_strFileName;
 	QString m_strCurrentDirectory;
 	QString m_strEnvironment;
+
+	/// <summary>
+	/// Pseudo console mode. Child sees a terminal so it line-buffers stdout
+	/// </summary>
+	bool m_bIsPseudoConsole;
+	short m_nPtyColumns;
+	short m_nPtyRows;
+	QPseudoConsole m_pseudoConsole;
+
+	/// <summary>
+	/// Expect matcher, fed by the reader thread
+	/// </summary>
+	bool m_bIsEnableExpect;
+	std::mutex m_lockExpect;
+	std::condition_variable m_cvExpect;
+	QExpectMatcher m_expect;
+	bool m_bIsOutputEnd;	//Reader thread stopped, no more data for Expect
+
+	/// <summary>
+	/// Completion port mode. Streams are null in polling mode.
+	/// m_lockRead keeps stdout and stderr callbacks from running at the same time
+	/// </summary>
+	QIoEngine m_ioEngine;
+	QCompletionEngine* m_pEngine;
+	QIoStream* m_pStreamOut;
+	QIoStream* m_pStreamErr;
+	QIoStream* m_pStreamIn;
+	std::mutex m_lockRead;
+	std::atomic<int> m_nOpenStreams;	//Read streams not ended yet
+
+	/// <summary>
+	/// Watchdog timers on the shared wheel.
+	/// Output only stores the time, the idle timer checks it when due
+	/// </summary>
+	DWORD m_dwDeadlineMs;
+	DWORD m_dwIdleTimeoutMs;
+	processFuncTimeoutCallBack m_funcTimeout;
+	QTIMER m_timerDeadline;
+	QTIMER m_timerIdle;
+	std::atomic<ULONGLONG> m_nLastOutputMs;
+	std::atomic_bool m_bIsKilled;		//Kill() called, timers stay disarmed
+
+	/// <summary>
+	/// Recent output for live inspection, filled by the reader. Empty when not enabled
+	/// </summary>
+	std::unique_ptr<QRetentionRing> m_pRetainOut;
+	std::unique_ptr<QRetentionRing> m_pRetainErr;
+
+	/// <summary>
+	/// Queued stdin in polling mode. Writer thread starts with the first queued write,
+	/// after that every write goes through the queue to keep the order
+	/// </summary>
+	mutable std::mutex m_lockStdin;
+	std::condition_variable m_cvStdin;
+	std::deque<std::shared_ptr<const std::string>> m_stdinQueue;
+	std::size_t m_nStdinBacklog;
+	bool m_bIsStdinBroken;
+	std::atomic_bool m_bStdinStop;
+	std::atomic_bool m_bStdinExited;
+	std::thread m_threadStdIn;
+
 	/// <summary>
 	/// Buffer receive from pipe. Default 4096
 	/// </summary>
@@ -136,17 +266,32 @@ private:
 	bool m_bIsClosed;
 private:
 	/// <summary>
-	/// Close handler
+	/// Win32 error of the failed step of Open(), 0 when none
 	/// </summary>
-	/// <param name="rhObject"></param>
-	void DestroyHandle(HANDLE&& rhObject);
+	DWORD m_dwSpawnError;
+private:
+	/// <summary>
+	/// Create the child, start reading only if not deferred
+	/// </summary>
+	/// <param name="config"></param>
+	/// <param name="isDeferStart">Leave readers and watchdog to Start()</param>
+	QProcess(QPROCESSCONFIG config, bool isDeferStart);
+
+	/// <summary>
+	/// Start readers, or register with the engine, and arm the watchdog
+	/// </summary>
+	void Start();
 
 	/// <summary>
-	/// Print error utility
+	/// Register the pipes of the child with the completion engine
 	/// </summary>
-	/// <param name="mess"></param>
-	/// <param name="location"></param>
-	void PrintError(const char* mess, const std::source_location& location = std::source_location::current());
+	void RegisterStreams();
+
+	/// <summary>
+	/// Close handler
+	/// </summary>
+	/// <param name="rhObject"></param>
+	void DestroyHandle(HANDLE&& rhObject);
 
 	/// <summary>
 	/// Create child process
@@ -163,7 +308,19 @@ private:
 	/// <param name="byte"></param>
 	/// <param name="length"></param>
 	/// <returns></returns>
-	bool Write(const char* byte, const size_t& length) const;
+	bool Write(const char* byte, const size_t& length);
+
+	/// <summary>
+	/// Queue shared buffer to stdin, returns without waiting for the child
+	/// </summary>
+	/// <param name="data"></param>
+	/// <returns>false when stdin is closed or broken</returns>
+	bool QueueWrite(std::shared_ptr<const std::string> data);
+
+	/// <summary>
+	/// Writer thread of queued stdin
+	/// </summary>
+	void StdinLoop();
 
 	/// <summary>
 	/// Start thread reading data out from pipe
@@ -176,11 +333,55 @@ private:
 	/// <returns></returns>
 	int Read();
 
+	/// <summary>
+	/// Hand data read from stdout/stderr pipe to the callbacks
+	/// </summary>
+	/// <param name="byteData"></param>
+	/// <param name="sizeData"></param>
+	void OnDataOut(const char* byteData, size_t sizeData);
+	void OnDataErr(const char* byteData, size_t sizeData);
+
+	/// <summary>
+	/// Wake Expect() waiting for data that will not come
+	/// </summary>
+	void OnOutputEnd();
+
 	/// <summary>
 	/// Entry point
 	/// </summary>
 	bool Open();
 
+	/// <summary>
+	/// Entry point for pseudo console mode
+	/// </summary>
+	bool OpenPseudoConsole();
+
+	/// <summary>
+	/// Entry point for completion port mode
+	/// </summary>
+	bool OpenCompletionPort();
+
+	/// <summary>
+	/// Read stream of the engine ended
+	/// </summary>
+	void OnStreamEnd();
+
+	/// <summary>
+	/// Arm deadline and idle timers
+	/// </summary>
+	void StartWatchdog();
+
+	/// <summary>
+	/// Idle timer due. Kill, or arm again for the rest if there was output since
+	/// </summary>
+	void OnIdleTimer();
+
+	/// <summary>
+	/// Kill child and its children, then notify
+	/// </summary>
+	/// <param name="kind"></param>
+	void OnTimeout(QTimeoutKind kind);
+
 
 public:
 
@@ -190,14 +391,92 @@ public:
 	void Close();
 
 	/// <summary>
-	/// Force kill process
+	/// Force kill process and the processes it started. Disarms the watchdog
 	/// </summary>
-	void Kill() const;
+	void Kill();
 
 	/// <summary>
 	/// Write to process
 	/// </summary>
 	void WriteCommand(const std::string& strCommand);
 
+	/// <summary>
+	/// Write bytes to process as is, no line ending added
+	/// </summary>
+	/// <param name="byte"></param>
+	/// <param name="length"></param>
+	/// <returns></returns>
+	bool WriteData(const char* byte, const size_t& length);
+
+	/// <summary>
+	/// Wait for child process to exit
+	/// </summary>
+	/// <param name="dwTimeoutMs">INFINITE to wait forever</param>
+	/// <returns>true when child process ended</returns>
+	bool WaitForExit(DWORD dwTimeoutMs) const;
+
+	/// <summary>
+	/// Id of the child process, 0 when it failed to start
+	/// </summary>
+	DWORD GetProcessId() const noexcept;
+
 	std::string ReadLineDataOut();
+
+	/// <summary>
+	/// Wait until stdout matches one of patterns.
+	/// Requires QPROCESSCONFIG::isEnableExpect
+	/// </summary>
+	/// <param name="patterns">Literal or regex patterns</param>
+	/// <param name="dwTimeoutMs">INFINITE to wait forever</param>
+	/// <returns>Matched pattern index and the text before it</returns>
+	QEXPECTRESULT Expect(const std::vector<QEXPECTPATTERN>& patterns, DWORD dwTimeoutMs);
+
+	/// <summary>
+	/// Change window size of pseudo console
+	/// </summary>
+	/// <param name="nColumns"></param>
+	/// <param name="nRows"></param>
+	/// <returns>false when not in pseudo console mode</returns>
+	bool ResizePseudoConsole(short nColumns, short nRows);
+
+	/// <summary>
+	/// Queue depth of the callback dispatcher.
+	/// Same value for both streams with QDispatchOrdering::PerProcess
+	/// </summary>
+	QQUEUEMETRICS GetStdOutQueueMetrics() const;
+	QQUEUEMETRICS GetStdErrQueueMetrics() const;
+
+	/// <summary>
+	/// Copy of the most recent output, with total bytes and lines so far.
+	/// Requires QPROCESSCONFIG::nRetentionBytes. Does not block the reader
+	/// </summary>
+	/// <param name="nMaxBytes">Limit of the tail</param>
+	/// <returns></returns>
+	QRETENTIONSNAPSHOT SnapshotStdOut(std::size_t nMaxBytes = SIZE_MAX) const;
+	QRETENTIONSNAPSHOT SnapshotStdErr(std::size_t nMaxBytes = SIZE_MAX) const;
+
+	/// <summary>
+	/// Stdin bytes queued and not written yet
+	/// </summary>
+	std::size_t GetStdInBacklog() const;
+
+	/// <summary>
+	/// Queue one buffer to the stdin of every process, without copying it.
+	/// Each process writes at its own pace, a slow child does not hold back the others
+	/// </summary>
+	/// <param name="processes"></param>
+	/// <param name="data">Shared by all processes until written</param>
+	/// <returns>Number of processes the data was queued to</returns>
+	static std::size_t BroadcastWrite(std::span<QProcess* const> processes, std::shared_ptr<const std::string> data);
+
+	/// <summary>
+	/// Launch a batch of children. Pipes and CreateProcess run in parallel on a
+	/// bounded set of threads, then every child is handed to its reader in one pass.
+	/// A failed item does not stop the others, one that fails to start reading is killed.
+	/// Readers are shared only with QIoEngine::CompletionPort, polling gives each child its own thread
+	/// </summary>
+	/// <param name="configs"></param>
+	/// <param name="nThreads">Spawn threads, 0 for the number of cores</param>
+	/// <returns>One result per config, same order</returns>
+	static std::vector<QSPAWNRESULT> SpawnMany(std::span<const QPROCESSCONFIG> configs, std::size_t nThreads = 0);
 };
\ No newline at end of file
@@ -0,0 +1,93 @@
+#include "QPseudoConsole.h"
+
+typedef HRESULT(WINAPI* PFN_CREATEPSEUDOCONSOLE)(COORD size, HANDLE hInput, HANDLE hOutput, DWORD dwFlags, void** phPC);
+typedef HRESULT(WINAPI* PFN_RESIZEPSEUDOCONSOLE)(void* hPC, COORD size);
+typedef void(WINAPI* PFN_CLOSEPSEUDOCONSOLE)(void* hPC);
+
+typedef struct _QCONPTYAPI {
+	PFN_CREATEPSEUDOCONSOLE pfnCreate;
+	PFN_RESIZEPSEUDOCONSOLE pfnResize;
+	PFN_CLOSEPSEUDOCONSOLE pfnClose;
+}QCONPTYAPI;
+
+static const QCONPTYAPI& ConPtyApi()
+{
+	static const QCONPTYAPI api = []() {
+		QCONPTYAPI result;
+		ZeroMemory(&result, sizeof(QCONPTYAPI));
+
+		HMODULE hKernel = GetModuleHandle(TEXT("kernel32.dll"));
+		if (hKernel != nullptr)
+		{
+			result.pfnCreate = reinterpret_cast<PFN_CREATEPSEUDOCONSOLE>(GetProcAddress(hKernel, "CreatePseudoConsole"));
+			result.pfnResize = reinterpret_cast<PFN_RESIZEPSEUDOCONSOLE>(GetProcAddress(hKernel, "ResizePseudoConsole"));
+			result.pfnClose = reinterpret_cast<PFN_CLOSEPSEUDOCONSOLE>(GetProcAddress(hKernel, "ClosePseudoConsole"));
+		}
+		return result;
+	}();
+	return api;
+}
+
+QPseudoConsole::QPseudoConsole() noexcept
+	: m_hPseudoConsole(nullptr)
+{
+}
+
+QPseudoConsole::~QPseudoConsole()
+{
+	Close();
+}
+
+bool QPseudoConsole::IsSupported() noexcept
+{
+	const QCONPTYAPI& api = ConPtyApi();
+	return api.pfnCreate != nullptr &&
+		api.pfnResize != nullptr &&
+		api.pfnClose != nullptr;
+}
+
+bool QPseudoConsole::Create(short nColumns, short nRows, HANDLE hInputRead, HANDLE hOutputWrite)
+{
+	if (!IsSupported() || IsOpen()) return false;
+
+	COORD size;
+	size.X = nColumns;
+	size.Y = nRows;
+
+	HRESULT hr = ConPtyApi().pfnCreate(size, hInputRead, hOutputWrite, 0, &m_hPseudoConsole);
+	if (FAILED(hr))
+	{
+		m_hPseudoConsole = nullptr;
+		SetLastError(static_cast<DWORD>(hr));
+		return false;
+	}
+	return true;
+}
+
+bool QPseudoConsole::Resize(short nColumns, short nRows) const
+{
+	if (!IsOpen()) return false;
+
+	COORD size;
+	size.X = nColumns;
+	size.Y = nRows;
+	return SUCCEEDED(ConPtyApi().pfnResize(m_hPseudoConsole, size));
+}
+
+void QPseudoConsole::Close() noexcept
+{
+	if (!IsOpen()) return;
+
+	ConPtyApi().pfnClose(m_hPseudoConsole);
+	m_hPseudoConsole = nullptr;
+}
+
+void* QPseudoConsole::Get() const noexcept
+{
+	return m_hPseudoConsole;
+}
+
+bool QPseudoConsole::IsOpen() const noexcept
+{
+	return m_hPseudoConsole != nullptr;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <Windows.h>
+
+#ifndef PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE
+#define PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE 0x00020016
+#endif
+
+/// <summary>
+/// ConPTY wrapper. Functions are resolved from kernel32 at runtime
+/// so the binary still starts on Windows older than 10 1809
+/// </summary>
+class QPseudoConsole
+{
+public:
+	QPseudoConsole() noexcept;
+	//Rule of five
+	QPseudoConsole(const QPseudoConsole& other) = delete;
+	const QPseudoConsole operator=(const QPseudoConsole& other) = delete;
+	QPseudoConsole(QPseudoConsole&& other) = delete;
+	const QPseudoConsole operator=(QPseudoConsole&& other) = delete;
+	virtual ~QPseudoConsole();
+public:
+	/// <summary>
+	/// ConPTY available on this system
+	/// </summary>
+	static bool IsSupported() noexcept;
+
+	/// <summary>
+	/// Create pseudo console on top of pipe ends.
+	/// The handles are duplicated by conhost, caller can close them after
+	/// </summary>
+	/// <param name="nColumns"></param>
+	/// <param name="nRows"></param>
+	/// <param name="hInputRead">Read end of the input pipe</param>
+	/// <param name="hOutputWrite">Write end of the output pipe</param>
+	/// <returns></returns>
+	bool Create(short nColumns, short nRows, HANDLE hInputRead, HANDLE hOutputWrite);
+
+	/// <summary>
+	/// Change window size seen by the child
+	/// </summary>
+	bool Resize(short nColumns, short nRows) const;
+
+	/// <summary>
+	/// Close pseudo console. Attached clients are terminated
+	/// </summary>
+	void Close() noexcept;
+
+	/// <summary>
+	/// Value for PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE
+	/// </summary>
+	void* Get() const noexcept;
+
+	bool IsOpen() const noexcept;
+private:
+	void* m_hPseudoConsole;	//HPCON
+};
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include "QRetentionRing.h"
+
+static std::size_t RoundUpPowerOfTwo(std::size_t nValue)
+{
+	std::size_t nResult = 1;
+	while (nResult < nValue)
+		nResult <<= 1;
+	return nResult;
+}
+
+QRetentionRing::QRetentionRing(std::size_t nCapacity)
+	: m_nCapacity(RoundUpPowerOfTwo((std::max)(nCapacity, static_cast<std::size_t>(1))))
+	, m_buffer(new char[m_nCapacity])
+	, m_nSequence(0)
+	, m_nTotalBytes(0)
+	, m_nTotalLines(0)
+	, m_nWriteEnd(0)
+{
+}
+
+void QRetentionRing::Append(const char* byteData, size_t sizeData)
+{
+	if (sizeData == 0) return;
+
+	//Only this thread changes the totals
+	std::uint64_t nPos = m_nTotalBytes.load(std::memory_order_relaxed);
+	std::uint64_t nLines = std::count(byteData, byteData + sizeData, '\n');
+
+	//Only the last capacity bytes of a big chunk survive
+	std::size_t nSkip = sizeData > m_nCapacity ? sizeData - m_nCapacity : 0;
+	const char* pCopy = byteData + nSkip;
+	std::size_t nCopy = sizeData - nSkip;
+
+	//Announce before overwriting, readers check it after their copy
+	m_nWriteEnd.store(nPos + sizeData, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	std::size_t nOffset = static_cast<std::size_t>((nPos + nSkip) & (m_nCapacity - 1));
+	std::size_t nFirst = (std::min)(nCopy, m_nCapacity - nOffset);
+	std::memcpy(m_buffer.get() + nOffset, pCopy, nFirst);
+	std::memcpy(m_buffer.get(), pCopy + nFirst, nCopy - nFirst);
+
+	std::uint64_t nSequence = m_nSequence.load(std::memory_order_relaxed);
+	m_nSequence.store(nSequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_nTotalBytes.store(nPos + sizeData, std::memory_order_relaxed);
+	m_nTotalLines.store(m_nTotalLines.load(std::memory_order_relaxed) + nLines, std::memory_order_relaxed);
+
+	m_nSequence.store(nSequence + 2, std::memory_order_release);
+}
+
+QRETENTIONSNAPSHOT QRetentionRing::Snapshot(std::size_t nMaxBytes) const
+{
+	QRETENTIONSNAPSHOT snapshot;
+
+	//Totals: retry while the writer is in between
+	for (;;)
+	{
+		std::uint64_t nSequence = m_nSequence.load(std::memory_order_acquire);
+		if (nSequence & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		snapshot.nTotalBytes = m_nTotalBytes.load(std::memory_order_relaxed);
+		snapshot.nTotalLines = m_nTotalLines.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_nSequence.load(std::memory_order_relaxed) == nSequence)
+			break;
+	}
+
+	std::size_t nLength = static_cast<std::size_t>((std::min<std::uint64_t>)(snapshot.nTotalBytes, (std::min)(m_nCapacity, nMaxBytes)));
+	std::uint64_t nBegin = snapshot.nTotalBytes - nLength;
+
+	snapshot.strTail.resize(nLength);
+	std::size_t nOffset = static_cast<std::size_t>(nBegin & (m_nCapacity - 1));
+	std::size_t nFirst = (std::min)(nLength, m_nCapacity - nOffset);
+	std::memcpy(snapshot.strTail.data(), m_buffer.get() + nOffset, nFirst);
+	std::memcpy(snapshot.strTail.data() + nFirst, m_buffer.get(), nLength - nFirst);
+
+	//Writer may have lapped the start of the copy, drop that part
+	std::atomic_thread_fence(std::memory_order_acquire);
+	std::uint64_t nWriteEnd = m_nWriteEnd.load(std::memory_order_relaxed);
+	std::uint64_t nValidFrom = nWriteEnd > m_nCapacity ? nWriteEnd - m_nCapacity : 0;
+	if (nValidFrom > nBegin)
+		snapshot.strTail.erase(0, static_cast<std::size_t>((std::min<std::uint64_t>)(nValidFrom - nBegin, nLength)));
+
+	return snapshot;
+}
+
+std::size_t QRetentionRing::Capacity() const noexcept
+{
+	return m_nCapacity;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+typedef struct _QRETENTIONSNAPSHOT {
+	std::string strTail;		//Most recent output, at most the ring capacity
+	std::uint64_t nTotalBytes;	//Written since start, strTail ends here
+	std::uint64_t nTotalLines;	//'\n' written since start
+}QRETENTIONSNAPSHOT, *PQRETENTIONSNAPSHOT;
+
+/// <summary>
+/// Bounded ring holding the tail of a stream.
+/// One writer, any number of readers, no locks on either side.
+/// Totals are published under a sequence counter. Before overwriting, the
+/// writer announces how far it will write, so a reader drops the part of its
+/// copy that may have been overwritten meanwhile instead of retrying
+/// </summary>
+class QRetentionRing
+{
+public:
+	/// <param name="nCapacity">Rounded up to a power of two</param>
+	explicit QRetentionRing(std::size_t nCapacity);
+	//Rule of five
+	QRetentionRing(const QRetentionRing& other) = delete;
+	const QRetentionRing operator=(const QRetentionRing& other) = delete;
+	QRetentionRing(QRetentionRing&& other) = delete;
+	const QRetentionRing operator=(QRetentionRing&& other) = delete;
+	virtual ~QRetentionRing() = default;
+
+	/// <summary>
+	/// Append output. Single writer only
+	/// </summary>
+	/// <param name="byteData"></param>
+	/// <param name="sizeData"></param>
+	void Append(const char* byteData, size_t sizeData);
+
+	/// <summary>
+	/// Consistent copy of the tail. Safe from any thread, never blocks the writer
+	/// </summary>
+	/// <param name="nMaxBytes">Limit of strTail</param>
+	QRETENTIONSNAPSHOT Snapshot(std::size_t nMaxBytes = SIZE_MAX) const;
+
+	std::size_t Capacity() const noexcept;
+private:
+	const std::size_t m_nCapacity;
+	std::unique_ptr<char[]> m_buffer;
+
+	std::atomic<std::uint64_t> m_nSequence;		//Odd while totals change
+	std::atomic<std::uint64_t> m_nTotalBytes;
+	std::atomic<std::uint64_t> m_nTotalLines;
+	std::atomic<std::uint64_t> m_nWriteEnd;		//Writer may be overwriting up to here
+};
@@ -0,0 +1,335 @@
+#include <format>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include "QShellSession.h"
+
+//Sentinel is "__QSS_<session>_<command>__". The command line splits it after
+//the head so an echoed command line can never look like the sentinel itself
+static const char* kTagHead = "__QSS";
+
+//How long a new shell gets to answer the first sentinel
+static constexpr std::chrono::milliseconds kStartTimeout(5000);
+
+//Wait before starting again a shell that failed to start, doubled up to the max
+static constexpr std::chrono::milliseconds kRestartBackoffMin(100);
+static constexpr std::chrono::milliseconds kRestartBackoffMax(10000);
+
+static std::atomic<std::uint64_t> g_nSessionSerial(0);
+
+QShellSession::QShellSession(QShellKind kind, QString strShell, QString strCurrentDirectory)
+	: m_kind(kind)
+	, m_strShell(!strShell.empty() ? std::move(strShell) :
+		kind == QShellKind::Cmd ? QString(TEXT("cmd /D /Q /K rem")) : QString(TEXT("sh")))
+	, m_strCurrentDirectory(std::move(strCurrentDirectory))
+	, m_nGeneration(0)
+	, m_nNextCommand(0)
+	, m_nRestartCount(0)
+	, m_bStop(false)
+{
+	m_strTagPrefix = std::format("_{}_{}_", GetCurrentProcessId(), g_nSessionSerial.fetch_add(1));
+
+	{
+		//On failure the monitor keeps trying, commands fail until then
+		std::lock_guard<std::mutex> lock(m_lockProcess);
+		StartLocked();
+	}
+
+	m_threadMonitor = std::thread([this]() { MonitorLoop(); });
+}
+
+QShellSession::~QShellSession()
+{
+	Close();
+}
+
+std::future<QSHELLRESULT> QShellSession::Submit(const std::string& strCommand)
+{
+	std::lock_guard<std::mutex> lock(m_lockProcess);
+
+	if (m_pProcess == nullptr)
+	{
+		//Closed, or the shell failed to start
+		std::promise<QSHELLRESULT> promise;
+		QSHELLRESULT result;
+		result.nExitCode = -1;
+		result.isShellDied = true;
+		result.isTimeout = false;
+		promise.set_value(std::move(result));
+		return promise.get_future();
+	}
+
+	return SubmitLocked(strCommand)->promise.get_future();
+}
+
+QSHELLRESULT QShellSession::Run(const std::string& strCommand, DWORD dwTimeoutMs)
+{
+	std::future<QSHELLRESULT> future = Submit(strCommand);
+
+	if (dwTimeoutMs != INFINITE &&
+		future.wait_for(std::chrono::milliseconds(dwTimeoutMs)) != std::future_status::ready)
+	{
+		QSHELLRESULT result;
+		result.nExitCode = -1;
+		result.isShellDied = false;
+		result.isTimeout = true;
+		return result;
+	}
+
+	return future.get();
+}
+
+std::uint64_t QShellSession::GetRestartCount() const noexcept
+{
+	return m_nRestartCount.load();
+}
+
+void QShellSession::Close()
+{
+	m_bStop = true;
+	if (m_threadMonitor.joinable())
+		m_threadMonitor.join();
+
+	std::lock_guard<std::mutex> lockProcess(m_lockProcess);
+	if (m_pProcess == nullptr) return;
+
+	//Let queued commands finish, then the shell leaves by itself
+	std::string strExit = m_kind == QShellKind::Cmd ? "exit\r\n" : "exit\n";
+	m_pProcess->WriteData(strExit.c_str(), strExit.size());
+	//Still busy with a long command. Close() only closes pipes, it would leave both running
+	if (!m_pProcess->WaitForExit(1000))
+		m_pProcess->Kill();
+	m_pProcess->Close();
+
+	std::deque<std::shared_ptr<QSHELLPENDING>> failed;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_nGeneration++;
+		FailPendingLocked(failed);
+	}
+	for (auto& pending : failed)
+		pending->promise.set_value(std::move(pending->result));
+
+	m_pProcess.reset();
+}
+
+bool QShellSession::StartLocked()
+{
+	std::uint64_t nGeneration;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		nGeneration = ++m_nGeneration;
+		m_strOutCarry.clear();
+		m_strErrCarry.clear();
+	}
+
+	QPROCESSCONFIG config = QPROCESSCONFIG(m_strShell, m_strCurrentDirectory,
+		[this, nGeneration](const char* byteData, const size_t& sizeData) {
+			OnStdOut(nGeneration, byteData, sizeData);
+		},
+		[this, nGeneration](const char* byteData, const size_t& sizeData) {
+			OnStdErr(nGeneration, byteData, sizeData);
+		});
+
+	auto pProcess = std::make_unique<QProcess>(config);
+	if (pProcess->GetProcessId() == 0)
+	{
+		PrintError("Start shell");
+		return false;
+	}
+	m_pProcess = std::move(pProcess);
+
+	//Empty command swallows banner and anything else printed on start
+	std::future<QSHELLRESULT> sync = SubmitLocked("")->promise.get_future();
+	return sync.wait_for(kStartTimeout) == std::future_status::ready &&
+		!sync.get().isShellDied;
+}
+
+bool QShellSession::RestartLocked()
+{
+	std::deque<std::shared_ptr<QSHELLPENDING>> failed;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_nGeneration++;
+		FailPendingLocked(failed);
+	}
+	for (auto& pending : failed)
+		pending->promise.set_value(std::move(pending->result));
+
+	//Reader callbacks of the old shell see a stale generation and return
+	if (m_pProcess != nullptr)
+	{
+		m_pProcess->Close();
+		m_pProcess.reset();
+	}
+
+	m_nRestartCount++;
+	return StartLocked();
+}
+
+std::shared_ptr<QShellSession::QSHELLPENDING> QShellSession::SubmitLocked(const std::string& strCommand)
+{
+	auto pending = std::make_shared<QSHELLPENDING>();
+	std::string strRest = std::format("{}{}__", m_strTagPrefix, m_nNextCommand++);
+	pending->strTag = kTagHead + strRest;
+	pending->result.nExitCode = -1;
+	pending->result.isShellDied = false;
+	pending->result.isTimeout = false;
+	pending->isOutDone = false;
+	pending->isErrDone = false;
+
+	std::string strScript;
+	if (m_kind == QShellKind::Cmd)
+	{
+		//%ERRORLEVEL% is expanded when its own line is read, after the command
+		strScript = std::format("{}\r\necho {}^{}:%ERRORLEVEL%\r\n1>&2 echo {}^{}\r\n",
+			strCommand, kTagHead, strRest, kTagHead, strRest);
+	}
+	else
+	{
+		strScript = std::format("{}\nprintf '%s%s:%d\\n' '{}' '{}' \"$?\"\nprintf '%s%s\\n' '{}' '{}' >&2\n",
+			strCommand, kTagHead, strRest, kTagHead, strRest);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_pending.push_back(pending);
+	}
+
+	//Pipelined: no wait for the previous command
+	m_pProcess->WriteData(strScript.c_str(), strScript.size());
+	return pending;
+}
+
+void QShellSession::OnStdOut(std::uint64_t nGeneration, const char* byteData, size_t sizeData)
+{
+	std::deque<std::shared_ptr<QSHELLPENDING>> completed;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (nGeneration != m_nGeneration) return;
+
+		m_strOutCarry.append(byteData, sizeData);
+		ParseLocked(true, completed);
+	}
+
+	for (auto& pending : completed)
+		pending->promise.set_value(std::move(pending->result));
+}
+
+void QShellSession::OnStdErr(std::uint64_t nGeneration, const char* byteData, size_t sizeData)
+{
+	std::deque<std::shared_ptr<QSHELLPENDING>> completed;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (nGeneration != m_nGeneration) return;
+
+		m_strErrCarry.append(byteData, sizeData);
+		ParseLocked(false, completed);
+	}
+
+	for (auto& pending : completed)
+		pending->promise.set_value(std::move(pending->result));
+}
+
+void QShellSession::ParseLocked(bool isStdOut, std::deque<std::shared_ptr<QSHELLPENDING>>& completed)
+{
+	std::string& strCarry = isStdOut ? m_strOutCarry : m_strErrCarry;
+
+	for (;;)
+	{
+		//Streams move on independently, each to its first unframed command
+		auto it = std::find_if(m_pending.begin(), m_pending.end(),
+			[isStdOut](const std::shared_ptr<QSHELLPENDING>& pending) {
+				return isStdOut ? !pending->isOutDone : !pending->isErrDone;
+			});
+
+		if (it == m_pending.end())
+		{
+			//Not asked for
+			strCarry.clear();
+			return;
+		}
+
+		QSHELLPENDING& pending = **it;
+		std::string& strText = isStdOut ? pending.result.strOut : pending.result.strErr;
+
+		std::size_t nPos = strCarry.find(pending.strTag);
+		if (nPos == std::string::npos)
+		{
+			//Hold back what may be the start of the sentinel
+			std::size_t nKeep = (std::min)(strCarry.size(), pending.strTag.size() - 1);
+			strText.append(strCarry, 0, strCarry.size() - nKeep);
+			strCarry.erase(0, strCarry.size() - nKeep);
+			return;
+		}
+
+		std::size_t nEol = strCarry.find('\n', nPos + pending.strTag.size());
+		strText.append(strCarry, 0, nPos);
+		if (nEol == std::string::npos)
+		{
+			//Sentinel line not complete yet
+			strCarry.erase(0, nPos);
+			return;
+		}
+
+		if (isStdOut)
+		{
+			//"<tag>:<exit code>"
+			pending.result.nExitCode = std::atoi(strCarry.c_str() + nPos + pending.strTag.size() + 1);
+			pending.isOutDone = true;
+		}
+		else
+		{
+			pending.isErrDone = true;
+		}
+		strCarry.erase(0, nEol + 1);
+
+		if (pending.isOutDone && pending.isErrDone)
+		{
+			completed.push_back(*it);
+			m_pending.erase(it);
+		}
+	}
+}
+
+void QShellSession::FailPendingLocked(std::deque<std::shared_ptr<QSHELLPENDING>>& failed)
+{
+	for (auto& pending : m_pending)
+	{
+		pending->result.isShellDied = true;
+		pending->result.nExitCode = -1;
+		failed.push_back(pending);
+	}
+	m_pending.clear();
+	m_strOutCarry.clear();
+	m_strErrCarry.clear();
+}
+
+void QShellSession::MonitorLoop()
+{
+	std::chrono::milliseconds backoff = kRestartBackoffMin;
+
+	while (!m_bStop)
+	{
+		//Only this thread and Close() replace m_pProcess
+		if (m_pProcess != nullptr && !m_pProcess->WaitForExit(100)) continue;
+		if (m_bStop) break;
+
+		bool bStarted;
+		{
+			std::lock_guard<std::mutex> lock(m_lockProcess);
+			bStarted = RestartLocked();
+		}
+
+		if (bStarted)
+		{
+			backoff = kRestartBackoffMin;
+			continue;
+		}
+
+		//Shell does not come up. Wait before the next try, stay responsive to Close()
+		for (auto waited = std::chrono::milliseconds(0); waited < backoff && !m_bStop; waited += std::chrono::milliseconds(100))
+			Sleep(100);
+		backoff = (std::min)(backoff * 2, kRestartBackoffMax);
+	}
+}
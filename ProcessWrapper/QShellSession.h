@@ -0,0 +1,119 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "QProcess.h"
+
+/// <summary>
+/// Shell syntax used for the sentinels
+/// </summary>
+enum class QShellKind
+{
+	Cmd,	//cmd.exe
+	Posix	//sh, bash
+};
+
+typedef struct _QSHELLRESULT {
+	std::string strOut;
+	std::string strErr;
+	int nExitCode;
+	bool isShellDied;	//Shell ended before the command finished, output may be partial
+	bool isTimeout;		//Run() gave up waiting, command is still queued
+}QSHELLRESULT, *PQSHELLRESULT;
+
+/// <summary>
+/// Runs commands on one long lived shell.
+/// After each command a unique sentinel is echoed to stdout (with the exit code)
+/// and to stderr, which frames the command's output on both streams.
+/// Commands are written as soon as they are submitted, results come back in order.
+/// If the shell dies, queued commands fail and a new shell is started.
+/// A shell that fails to start is tried again with growing delay, commands fail meanwhile
+/// </summary>
+class QShellSession
+{
+public:
+	QShellSession(QShellKind kind = QShellKind::Cmd,
+		QString strShell = QString(),
+		QString strCurrentDirectory = QString());
+	//Rule of five
+	QShellSession(const QShellSession& other) = delete;
+	const QShellSession operator=(const QShellSession& other) = delete;
+	QShellSession(QShellSession&& other) = delete;
+	const QShellSession operator=(QShellSession&& other) = delete;
+	virtual ~QShellSession();
+
+	/// <summary>
+	/// Queue command without waiting for the previous ones
+	/// </summary>
+	/// <param name="strCommand">Single line command</param>
+	/// <returns></returns>
+	std::future<QSHELLRESULT> Submit(const std::string& strCommand);
+
+	/// <summary>
+	/// Submit and wait
+	/// </summary>
+	/// <param name="strCommand"></param>
+	/// <param name="dwTimeoutMs">INFINITE to wait forever</param>
+	/// <returns></returns>
+	QSHELLRESULT Run(const std::string& strCommand, DWORD dwTimeoutMs = INFINITE);
+
+	/// <summary>
+	/// Number of times the shell had to be started again
+	/// </summary>
+	std::uint64_t GetRestartCount() const noexcept;
+
+	/// <summary>
+	/// Ask the shell to exit, kill it and its commands if still running after 1 s.
+	/// Commands without a result fail
+	/// </summary>
+	void Close();
+private:
+	typedef struct _QSHELLPENDING {
+		std::string strTag;
+		std::promise<QSHELLRESULT> promise;
+		QSHELLRESULT result;
+		bool isOutDone;
+		bool isErrDone;
+	}QSHELLPENDING;
+
+	const QShellKind m_kind;
+	const QString m_strShell;
+	const QString m_strCurrentDirectory;
+
+	/// <summary>
+	/// Guards the process pointer and the write order.
+	/// Held while the shell is restarted
+	/// </summary>
+	std::mutex m_lockProcess;
+	std::unique_ptr<QProcess> m_pProcess;
+
+	/// <summary>
+	/// Guards parsing state. Taken by reader callbacks
+	/// </summary>
+	std::mutex m_lock;
+	std::deque<std::shared_ptr<QSHELLPENDING>> m_pending;
+	std::string m_strOutCarry;		//stdout not framed yet
+	std::string m_strErrCarry;		//stderr not framed yet
+	std::uint64_t m_nGeneration;	//Output of a dead shell is ignored
+
+	std::string m_strTagPrefix;
+	std::uint64_t m_nNextCommand;
+	std::atomic<std::uint64_t> m_nRestartCount;
+
+	std::atomic_bool m_bStop;
+	std::thread m_threadMonitor;	//Detects dead shell
+private:
+	bool StartLocked();
+	bool RestartLocked();
+	std::shared_ptr<QSHELLPENDING> SubmitLocked(const std::string& strCommand);
+	void OnStdOut(std::uint64_t nGeneration, const char* byteData, size_t sizeData);
+	void OnStdErr(std::uint64_t nGeneration, const char* byteData, size_t sizeData);
+	void ParseLocked(bool isStdOut, std::deque<std::shared_ptr<QSHELLPENDING>>& completed);
+	void FailPendingLocked(std::deque<std::shared_ptr<QSHELLPENDING>>& failed);
+	void MonitorLoop();
+};
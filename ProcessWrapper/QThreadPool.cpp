@@ -0,0 +1,139 @@
+#include <algorithm>
+#include "QThreadPool.h"
+
+//Pool and slot of the current thread, used to keep nested submit local
+static thread_local QThreadPool* t_pOwnerPool = nullptr;
+static thread_local std::size_t t_nWorkerIndex = 0;
+
+QThreadPool::QThreadPool(std::size_t nThreads)
+	: m_bStop(false)
+	, m_nPending(0)
+	, m_nNext(0)
+{
+	if (nThreads == 0)
+		nThreads = std::max<std::size_t>(2, std::thread::hardware_concurrency());
+
+	m_workers.reserve(nThreads);
+	for (std::size_t i = 0; i < nThreads; ++i)
+		m_workers.push_back(std::make_unique<Worker>());
+
+	m_threads.reserve(nThreads);
+	for (std::size_t i = 0; i < nThreads; ++i)
+		m_threads.emplace_back([this, i]() { WorkerLoop(i); });
+}
+
+QThreadPool::~QThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lockIdle);
+		m_bStop = true;
+	}
+	m_cvIdle.notify_all();
+
+	for (auto& thread : m_threads)
+	{
+		if (thread.joinable())
+			thread.join();
+	}
+}
+
+void QThreadPool::Submit(QTask task)
+{
+	Push(std::move(task), false);
+}
+
+void QThreadPool::Requeue(QTask task)
+{
+	//Owner pops the back, so the front runs after everything queued here
+	Push(std::move(task), true);
+}
+
+void QThreadPool::Push(QTask task, bool isFront)
+{
+	std::size_t index;
+	if (t_pOwnerPool == this)
+		index = t_nWorkerIndex;
+	else
+		index = m_nNext.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+
+	{
+		std::lock_guard<std::mutex> lock(m_workers[index]->lock);
+		if (isFront)
+			m_workers[index]->tasks.push_front(std::move(task));
+		else
+			m_workers[index]->tasks.push_back(std::move(task));
+	}
+
+	//Publish under idle lock so a worker going to sleep can not miss it
+	{
+		std::lock_guard<std::mutex> lock(m_lockIdle);
+		m_nPending.fetch_add(1, std::memory_order_release);
+	}
+	m_cvIdle.notify_one();
+}
+
+std::size_t QThreadPool::Size() const noexcept
+{
+	return m_threads.size();
+}
+
+QThreadPool& QThreadPool::Shared()
+{
+	static QThreadPool pool;
+	return pool;
+}
+
+bool QThreadPool::TryPop(std::size_t index, QTask& task)
+{
+	Worker& worker = *m_workers[index];
+	std::lock_guard<std::mutex> lock(worker.lock);
+	if (worker.tasks.empty()) return false;
+
+	task = std::move(worker.tasks.back());
+	worker.tasks.pop_back();
+	return true;
+}
+
+bool QThreadPool::TrySteal(std::size_t index, QTask& task)
+{
+	const std::size_t count = m_workers.size();
+	for (std::size_t i = 1; i < count; ++i)
+	{
+		Worker& victim = *m_workers[(index + i) % count];
+		std::unique_lock<std::mutex> lock(victim.lock, std::try_to_lock);
+		if (!lock.owns_lock() || victim.tasks.empty()) continue;
+
+		task = std::move(victim.tasks.front());
+		victim.tasks.pop_front();
+		return true;
+	}
+	return false;
+}
+
+void QThreadPool::WorkerLoop(std::size_t index)
+{
+	t_pOwnerPool = this;
+	t_nWorkerIndex = index;
+
+	for (;;)
+	{
+		QTask task;
+		if (TryPop(index, task) || TrySteal(index, task))
+		{
+			m_nPending.fetch_sub(1, std::memory_order_acq_rel);
+			task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_lockIdle);
+		//Drain everything before leaving
+		if (m_bStop && m_nPending.load(std::memory_order_acquire) == 0)
+			break;
+
+		m_cvIdle.wait(lock, [this]() {
+			return m_bStop || m_nPending.load(std::memory_order_acquire) > 0;
+		});
+	}
+
+	t_pOwnerPool = nullptr;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <atomic>
+
+typedef std::function<void()> QTask;
+
+/// <summary>
+/// Work-stealing thread pool.
+/// Each worker owns a deque: the owner pushes/pops at the back,
+/// idle workers steal from the front of the others.
+/// </summary>
+class QThreadPool
+{
+public:
+	explicit QThreadPool(std::size_t nThreads = 0);
+	//Rule of five
+	QThreadPool(const QThreadPool& other) = delete;
+	const QThreadPool operator=(const QThreadPool& other) = delete;
+	QThreadPool(QThreadPool&& other) = delete;
+	const QThreadPool operator=(QThreadPool&& other) = delete;
+	virtual ~QThreadPool();
+
+	/// <summary>
+	/// Queue task. Task submitted from a worker stays on that worker
+	/// </summary>
+	/// <param name="task"></param>
+	void Submit(QTask task);
+
+	/// <summary>
+	/// Queue task behind the work already waiting on this worker, instead of on top.
+	/// For a long running task that gives up the worker to let others run first
+	/// </summary>
+	/// <param name="task"></param>
+	void Requeue(QTask task);
+
+	/// <summary>
+	/// Number of worker threads
+	/// </summary>
+	std::size_t Size() const noexcept;
+
+	/// <summary>
+	/// Process wide pool, sized to hardware concurrency
+	/// </summary>
+	static QThreadPool& Shared();
+private:
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<QTask> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::vector<std::thread> m_threads;
+
+	/// <summary>
+	/// Idle workers sleep here until a task is queued
+	/// </summary>
+	std::mutex m_lockIdle;
+	std::condition_variable m_cvIdle;
+
+	std::atomic_bool m_bStop;
+	std::atomic<std::size_t> m_nPending;	//Queued but not yet taken
+	std::atomic<std::size_t> m_nNext;		//Round robin for external submit
+private:
+	void Push(QTask task, bool isFront);
+	bool TryPop(std::size_t index, QTask& task);
+	bool TrySteal(std::size_t index, QTask& task);
+	void WorkerLoop(std::size_t index);
+};
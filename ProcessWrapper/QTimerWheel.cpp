@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <chrono>
+#include "QTimerWheel.h"
+
+QTimerWheel::QTimerWheel(DWORD dwTickMs)
+	: m_dwTickMs((std::max)(dwTickMs, static_cast<DWORD>(1)))
+	, m_nStartMs(GetTickCount64())
+	, m_nCurrentTick(0)
+	, m_nArmed(0)
+	, m_pFiring(nullptr)
+	, m_bStop(false)
+{
+	for (int nLevel = 0; nLevel < kLevels; ++nLevel)
+	{
+		for (std::size_t nSlot = 0; nSlot < kSlots; ++nSlot)
+			m_slots[nLevel][nSlot] = nullptr;
+	}
+
+	m_thread = std::thread([this]() { WheelLoop(); });
+}
+
+QTimerWheel::~QTimerWheel()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_bStop = true;
+	}
+	m_cvWake.notify_all();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+QTimerWheel& QTimerWheel::Shared()
+{
+	static QTimerWheel wheel(10);
+	return wheel;
+}
+
+void QTimerWheel::Arm(PQTIMER pTimer, DWORD dwDelayMs)
+{
+	bool bWasEmpty;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (pTimer->ppSlot != nullptr)
+			RemoveLocked(pTimer);
+
+		//Empty wheel may be far behind, jump instead of turning through idle ticks.
+		//Not while a callback runs, the wheel is in the middle of a tick
+		bWasEmpty = m_nArmed == 0;
+		std::uint64_t nNow = NowTick();
+		if (bWasEmpty && m_pFiring == nullptr)
+			m_nCurrentTick = (std::max)(m_nCurrentTick, nNow);
+
+		pTimer->nExpireTick = nNow + (static_cast<std::uint64_t>(dwDelayMs) + m_dwTickMs - 1) / m_dwTickMs;
+		InsertLocked(pTimer);
+	}
+
+	//Wheel thread sleeps without timeout when nothing is armed
+	if (bWasEmpty)
+		m_cvWake.notify_one();
+}
+
+bool QTimerWheel::Cancel(PQTIMER pTimer)
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	bool bArmed = pTimer->ppSlot != nullptr;
+
+	for (;;)
+	{
+		//Again after the wait, the callback may have armed it
+		if (pTimer->ppSlot != nullptr)
+			RemoveLocked(pTimer);
+
+		if (m_pFiring != pTimer ||
+			std::this_thread::get_id() == m_thread.get_id())
+			break;
+
+		m_cvFired.wait(lock);
+	}
+
+	return bArmed;
+}
+
+std::size_t QTimerWheel::GetArmedCount() const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_nArmed;
+}
+
+std::uint64_t QTimerWheel::NowTick() const
+{
+	return (GetTickCount64() - m_nStartMs) / m_dwTickMs;
+}
+
+void QTimerWheel::InsertLocked(PQTIMER pTimer)
+{
+	//Due now or overdue: next tick
+	std::uint64_t nExpire = (std::max)(pTimer->nExpireTick, m_nCurrentTick + 1);
+
+	//Farther than the wheel reaches: park at its far end
+	const std::uint64_t nMaxDelta = (1ull << (kSlotBits * kLevels)) - 1;
+	if (nExpire - m_nCurrentTick > nMaxDelta)
+		nExpire = m_nCurrentTick + nMaxDelta;
+	pTimer->nExpireTick = nExpire;
+
+	std::uint64_t nDelta = nExpire - m_nCurrentTick;
+	int nLevel = 0;
+	while (nLevel < kLevels - 1 && nDelta >= (1ull << (kSlotBits * (nLevel + 1))))
+		nLevel++;
+
+	std::size_t nSlot = (nExpire >> (kSlotBits * nLevel)) & (kSlots - 1);
+	PQTIMER& pHead = m_slots[nLevel][nSlot];
+
+	pTimer->pPrev = nullptr;
+	pTimer->pNext = pHead;
+	if (pHead != nullptr)
+		pHead->pPrev = pTimer;
+	pHead = pTimer;
+	pTimer->ppSlot = &pHead;
+
+	m_nArmed++;
+}
+
+void QTimerWheel::RemoveLocked(PQTIMER pTimer)
+{
+	if (pTimer->pPrev != nullptr)
+		pTimer->pPrev->pNext = pTimer->pNext;
+	else
+		*pTimer->ppSlot = pTimer->pNext;
+
+	if (pTimer->pNext != nullptr)
+		pTimer->pNext->pPrev = pTimer->pPrev;
+
+	pTimer->pPrev = nullptr;
+	pTimer->pNext = nullptr;
+	pTimer->ppSlot = nullptr;
+
+	m_nArmed--;
+}
+
+void QTimerWheel::CascadeLocked(int nLevel, std::size_t nSlot)
+{
+	//Everything here is due within the range of the levels below
+	PQTIMER& pHead = m_slots[nLevel][nSlot];
+	while (pHead != nullptr)
+	{
+		PQTIMER pTimer = pHead;
+		RemoveLocked(pTimer);
+		InsertLocked(pTimer);
+	}
+}
+
+void QTimerWheel::TickLocked(std::unique_lock<std::mutex>& lock)
+{
+	std::uint64_t nTick = ++m_nCurrentTick;
+	std::size_t nIndex = nTick & (kSlots - 1);
+
+	//Level below wrapped: bring the next slot of each level above down
+	if (nIndex == 0)
+	{
+		for (int nLevel = 1; nLevel < kLevels; ++nLevel)
+		{
+			std::size_t nSlot = (nTick >> (kSlotBits * nLevel)) & (kSlots - 1);
+			CascadeLocked(nLevel, nSlot);
+			if (nSlot != 0) break;
+		}
+	}
+
+	//Timers armed by a callback are due next tick at the earliest, never in this slot
+	PQTIMER& pHead = m_slots[0][nIndex];
+	while (pHead != nullptr)
+	{
+		PQTIMER pTimer = pHead;
+		RemoveLocked(pTimer);
+		m_pFiring = pTimer;
+
+		lock.unlock();
+		if (pTimer->callback)
+			pTimer->callback();
+		lock.lock();
+
+		m_pFiring = nullptr;
+		m_cvFired.notify_all();
+	}
+}
+
+void QTimerWheel::WheelLoop()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+
+	while (!m_bStop)
+	{
+		if (m_nArmed == 0)
+		{
+			m_cvWake.wait(lock, [this]() { return m_bStop || m_nArmed > 0; });
+			continue;
+		}
+
+		std::uint64_t nNow = NowTick();
+		while (!m_bStop && m_nCurrentTick < nNow)
+		{
+			if (m_nArmed == 0)
+			{
+				m_nCurrentTick = nNow;
+				break;
+			}
+			TickLocked(lock);
+		}
+
+		m_cvWake.wait_for(lock, std::chrono::milliseconds(m_dwTickMs));
+	}
+}
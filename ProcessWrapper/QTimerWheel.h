@@ -0,0 +1,101 @@
+#pragma once
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <cstdint>
+#include <Windows.h>
+
+typedef std::function<void()> QTimerCallback;
+
+/// <summary>
+/// Timer owned by the caller, linked into a wheel slot while armed.
+/// Must stay alive until it fires or is cancelled
+/// </summary>
+typedef struct _QTIMER {
+	_QTIMER* pPrev;
+	_QTIMER* pNext;
+	_QTIMER** ppSlot;			//Head of slot holding the timer, nullptr when not armed
+	std::uint64_t nExpireTick;
+	QTimerCallback callback;	//Runs on the wheel thread
+
+public:
+	_QTIMER(QTimerCallback func = nullptr)
+		: pPrev(nullptr)
+		, pNext(nullptr)
+		, ppSlot(nullptr)
+		, nExpireTick(0)
+		, callback(std::move(func))
+	{
+	}
+}QTIMER, *PQTIMER;
+
+/// <summary>
+/// Hierarchical timer wheel: 4 levels of 256 slots.
+/// Arm and Cancel only link/unlink a list node. Level 0 holds timers due in
+/// the next 256 ticks, each level above covers 256 times the range below and
+/// is cascaded down one slot at a time as the wheel turns.
+/// One thread drives the wheel and runs the callbacks
+/// </summary>
+class QTimerWheel
+{
+public:
+	explicit QTimerWheel(DWORD dwTickMs = 10);
+	//Rule of five
+	QTimerWheel(const QTimerWheel& other) = delete;
+	const QTimerWheel operator=(const QTimerWheel& other) = delete;
+	QTimerWheel(QTimerWheel&& other) = delete;
+	const QTimerWheel operator=(QTimerWheel&& other) = delete;
+	virtual ~QTimerWheel();
+
+	/// <summary>
+	/// Process wide wheel, 10 ms tick
+	/// </summary>
+	static QTimerWheel& Shared();
+
+	/// <summary>
+	/// Arm timer, or move it if already armed.
+	/// May be called from a callback, also for the timer being fired
+	/// </summary>
+	/// <param name="pTimer"></param>
+	/// <param name="dwDelayMs">Rounded up to the tick</param>
+	void Arm(PQTIMER pTimer, DWORD dwDelayMs);
+
+	/// <summary>
+	/// Disarm timer. If its callback is running on the wheel thread,
+	/// wait for it to return, unless called from that callback
+	/// </summary>
+	/// <returns>true when the timer was armed</returns>
+	bool Cancel(PQTIMER pTimer);
+
+	/// <summary>
+	/// Number of armed timers
+	/// </summary>
+	std::size_t GetArmedCount() const;
+private:
+	static constexpr int kLevels = 4;
+	static constexpr int kSlotBits = 8;
+	static constexpr std::size_t kSlots = 1 << kSlotBits;
+
+	const DWORD m_dwTickMs;
+	const ULONGLONG m_nStartMs;
+
+	mutable std::mutex m_lock;
+	std::condition_variable m_cvWake;	//Wheel thread, new timer or stop
+	std::condition_variable m_cvFired;	//Cancel waiting for a running callback
+
+	PQTIMER m_slots[kLevels][kSlots];
+	std::uint64_t m_nCurrentTick;	//Last tick processed
+	std::size_t m_nArmed;
+	PQTIMER m_pFiring;				//Callback running now
+
+	bool m_bStop;
+	std::thread m_thread;
+private:
+	std::uint64_t NowTick() const;
+	void InsertLocked(PQTIMER pTimer);
+	void RemoveLocked(PQTIMER pTimer);
+	void CascadeLocked(int nLevel, std::size_t nSlot);
+	void TickLocked(std::unique_lock<std::mutex>& lock);
+	void WheelLoop();
+};
@@ -1,5 +1,6 @@
-#include <string>
-#include <Windows.h>
+#include <iostream>
+#include <format>
+#include "Utility.h"
 
 
 extern std::string utf8_encode(const std::wstring& wstr)
@@ -20,3 +21,28 @@ extern std::wstring utf8_decode(const std::string& str)
     MultiByteToWideChar(CP_UTF8, 0, &str[0], (int)str.size(), &wstrTo[0], size_needed);
     return wstrTo;
 }
+
+
+
+void TraceW(const std::string& data)
+{
+    std::wstring dataW = std::move(utf8_decode(data));
+    OutputDebugStringW(dataW.c_str());
+}
+
+void TraceA(const std::string& data)
+{
+    OutputDebugStringA(data.c_str());
+}
+
+void PrintError(const char* mess, const std::source_location& location)
+{
+    std::string dataFormat = std::format("Error. Message: {}. Function: {}. Line: {}",
+        mess,
+        location.function_name(),
+        location.line());
+
+    std::cout << dataFormat << std::endl;
+
+    TRACE_ERROR(dataFormat);
+}
\ No newline at end of file
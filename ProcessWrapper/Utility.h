@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <source_location>
+#include <Windows.h>
+
+std::string utf8_encode(const std::wstring& wstr);
+std::wstring utf8_decode(const std::string& str);
+
+void TraceW(const std::string& data);
+void TraceA(const std::string& data);
+
+/// <summary>
+/// Print error utility, to stdout and the debugger
+/// </summary>
+/// <param name="mess"></param>
+/// <param name="location"></param>
+void PrintError(const char* mess, const std::source_location& location = std::source_location::current());
+
+#ifdef  UNICODE
+typedef std::wstring QString;
+#define TRACE_ERROR TraceW
+#else
+typedef std::string QString;
+#define TRACE_ERROR TraceA
+#endif
\ No newline at end of file
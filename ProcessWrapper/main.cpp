@@ -1,5 +1,9 @@
 #include <iostream>
 #include "QProcess.h"
+#include "QLeanProcess.h"
+#include "QShellSession.h"
+
+extern void RunBenchmarks(const std::string& strName);
 
 void DataOut(const char* data, const size_t& size)
 {
@@ -49,11 +53,205 @@ void Test2()
 	delete cmdProcess;
 }
 
+void Test3()
+{
+	//Slow consumer runs on its own thread, reader keeps draining the pipe
+	QPROCESSCONFIG config = QPROCESSCONFIG("cmd", "", DataOut,
+		ErrorOut);
+	config.dispatchConfig = QDISPATCHCONFIG(QDispatchMode::DedicatedThread,
+		QOverflowPolicy::SpillToDisk,
+		QDispatchOrdering::PerProcess,
+		64 * 1024);
+
+	QProcess* cmdProcess = new QProcess(config);
+
+	cmdProcess->WriteCommand("dir /s C:\\Windows\\System32\\drivers");
+	Sleep(1000);
+
+	QQUEUEMETRICS metrics = cmdProcess->GetStdOutQueueMetrics();
+	std::cout << "Queue depth: " << metrics.nDepthBytes
+		<< " High water: " << metrics.nHighWaterBytes
+		<< " Spilled: " << metrics.nSpilledBytes << std::endl;
+
+	cmdProcess->Close();
+	delete cmdProcess;
+}
+
+void Test4()
+{
+	//Wait for the prompt instead of sleeping
+	QPROCESSCONFIG config = QPROCESSCONFIG("cmd");
+	config.isEnableExpect = true;
+
+	QProcess* cmdProcess = new QProcess(config);
+
+	QEXPECTRESULT result = cmdProcess->Expect({ ">" }, 2000);
+	std::cout << "Banner: " << result.strBefore << std::endl;
+
+	cmdProcess->WriteCommand("ver");
+	result = cmdProcess->Expect({ { "Version [0-9.]+", true }, "not recognized" }, 2000);
+	if (result.nIndex == 0)
+		std::cout << "Found: " << result.strMatch << std::endl;
+	else if (result.isTimeout)
+		std::cout << "Timeout" << std::endl;
+
+	cmdProcess->Close();
+	delete cmdProcess;
+}
+
+void Test5()
+{
+	//One cmd for many commands, each with its own output and exit code
+	QShellSession session;
+
+	QSHELLRESULT result = session.Run("cd /d C:");
+	std::cout << "Exit code: " << result.nExitCode << std::endl;
 
-int main(void)
+	std::future<QSHELLRESULT> dir = session.Submit("dir /b");
+	std::future<QSHELLRESULT> missing = session.Submit("type not_exist.txt");
+
+	result = dir.get();
+	std::cout << result.strOut << std::endl;
+
+	result = missing.get();
+	std::cout << "Exit code: " << result.nExitCode << " Error: " << result.strErr << std::endl;
+
+	session.Close();
+}
+
+void Test6()
 {
+	//No reader thread, output arrives on the shared completion port
+	QPROCESSCONFIG config = QPROCESSCONFIG("cmd", "",
+		[](const char* data, const size_t& size) {
+			std::cout << std::string(data, size);
+		});
+	config.ioEngine = QIoEngine::CompletionPort;
+
+	QProcess* cmdProcess = new QProcess(config);
+
+	cmdProcess->WriteCommand("dir");
+	Sleep(1000);
+	std::cout << "Stdin backlog: " << cmdProcess->GetStdInBacklog() << std::endl;
+
+	cmdProcess->Close();
+	delete cmdProcess;
+}
+
+void Test7()
+{
+	//Killed after 2 seconds without output, or 10 seconds in total.
+	//ping prints every second, so the deadline hits first
+	QPROCESSCONFIG config = QPROCESSCONFIG("ping -n 30 127.0.0.1");
+	config.dwDeadlineMs = 10000;
+	config.dwIdleTimeoutMs = 2000;
+	config.timeoutFunc = [](QTimeoutKind kind) {
+		std::cout << (kind == QTimeoutKind::Deadline ? "Deadline" : "Idle output") << " timeout" << std::endl;
+	};
+
+	QProcess* pingProcess = new QProcess(config);
+	pingProcess->WaitForExit(INFINITE);
+	pingProcess->Close();
+	delete pingProcess;
+}
+
+void Test8()
+{
+	//Look at the last output from another thread, no callback needed
+	QPROCESSCONFIG config = QPROCESSCONFIG("ping -n 5 127.0.0.1");
+	config.nRetentionBytes = 1024;
+
+	QProcess* pingProcess = new QProcess(config);
+	Sleep(2500);
+
+	QRETENTIONSNAPSHOT snapshot = pingProcess->SnapshotStdOut(200);
+	std::cout << snapshot.nTotalLines << " lines, " << snapshot.nTotalBytes << " bytes. Last:" << std::endl
+		<< snapshot.strTail << std::endl;
+
+	pingProcess->WaitForExit(INFINITE);
+	pingProcess->Close();
+	delete pingProcess;
+}
+
+void Test9()
+{
+	//Same input to several children, one buffer for all
+	auto printer = [](const char* data, const size_t& size) {
+		std::cout << std::string(data, size);
+	};
+
+	QProcess first(QPROCESSCONFIG("cmd", "", printer));
+	QProcess second(QPROCESSCONFIG("cmd", "", printer));
+	QProcess* targets[] = { &first, &second };
+
+	auto input = std::make_shared<const std::string>("echo broadcast\r\nexit\r\n");
+	std::size_t nQueued = QProcess::BroadcastWrite(targets, input);
+	std::cout << "Queued to " << nQueued << " processes" << std::endl;
+
+	first.WaitForExit(INFINITE);
+	second.WaitForExit(INFINITE);
+}
+
+void Test10()
+{
+	//Only stdout, lambda called directly, no std::function and no unused pipes
+	auto printer = [](const char* data, const size_t& size) {
+		std::cout << std::string(data, size);
+	};
+
+	QLeanProcess<QRedirectStdOut, QCallback<decltype(printer)>, QChar<char>> process("cmd /c ver", printer);
+	process.WaitForExit(INFINITE);
+	process.Close();
+}
+
+void Test11()
+{
+	//Several children started together, a bad command does not stop the others
+	auto printer = [](const char* data, const size_t& size) {
+		std::cout << std::string(data, size);
+	};
+
+	std::vector<QPROCESSCONFIG> configs;
+	configs.push_back(QPROCESSCONFIG("cmd /c echo first", "", printer));
+	configs.push_back(QPROCESSCONFIG("not_a_command.exe", "", printer));
+	configs.push_back(QPROCESSCONFIG("cmd /c echo third", "", printer));
+
+	std::vector<QSPAWNRESULT> results = QProcess::SpawnMany(configs);
+	for (auto& result : results)
+	{
+		if (!result.isSuccess)
+		{
+			std::cout << "Spawn failed, error " << result.dwError << std::endl;
+			continue;
+		}
+
+		std::cout << "Spawned pid " << result.dwProcessId << std::endl;
+		result.pProcess->WaitForExit(INFINITE);
+		result.pProcess->Close();
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	//ProcessWrapper.exe bench [name]
+	if (argc > 1 && std::string(argv[1]) == "bench")
+	{
+		RunBenchmarks(argc > 2 ? argv[2] : "");
+		return 0;
+	}
+
 	Test1();
 	Test2();
+	Test3();
+	Test4();
+	Test5();
+	Test6();
+	Test7();
+	Test8();
+	Test9();
+	Test10();
+	Test11();
 
 
 	std::getchar();